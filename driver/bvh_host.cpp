@@ -6,6 +6,19 @@
 #include "bvh_host.h"
 #include "bvh/v2/tri.h"
 
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <numeric>
+#include <string>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 using Scalar  = float;
 using Vec3    = bvh::v2::Vec<Scalar, 3>;
 using BBBox    = bvh::v2::BBox<Scalar, 3>;
@@ -24,139 +37,1473 @@ static inline Vec3 nasl2bvh(vec3 v) {
 
 using namespace shady;
 
-static int count_tris(BVH* bvh, int i, int* maxdepth, int depth = 1) {
+static TriangleIsect make_isect(const Model& model, int prim_id) {
+    const IndexedTriangle& tri = model.triangles[prim_id];
+    vec3 v0 = model.positions[tri.vertices[0]];
+    return TriangleIsect {
+        .v0 = v0,
+        .e1 = model.positions[tri.vertices[1]] - v0,
+        .e2 = model.positions[tri.vertices[2]] - v0,
+        .prim_id = prim_id,
+    };
+}
+
+// Degenerate primitive used for padding, it can never be hit
+static TriangleIsect make_padding_isect() {
+    return TriangleIsect {
+        .v0 = vec3(0.0f),
+        .e1 = vec3(0.0f),
+        .e2 = vec3(0.0f),
+        .prim_id = -1,
+    };
+}
+
+// Meshes are counted once per instance, but only walked once
+static size_t count_tris(BVH* bvh, uint32_t child, int* maxdepth, std::unordered_map<uint32_t, std::pair<size_t, int>>& meshes, int depth = 1) {
     if (depth > *maxdepth)
         *maxdepth = depth;
-    BVH::Node* n = &bvh->nodes[i];
-    if (n->is_leaf)
-        return n->leaf.count;
-    else
-        return count_tris(bvh, n->inner.children[0], maxdepth, depth + 1) + count_tris(bvh, n->inner.children[1], maxdepth, depth + 1);
+    if (bvh_is_leaf(child) && bvh->instances) {
+        uint32_t root = bvh->instances[bvh_leaf_start(child)].root;
+        auto it = meshes.find(root);
+        if (it == meshes.end()) {
+            BVH mesh = *bvh;
+            mesh.instances = nullptr;
+            int mesh_depth = 0;
+            size_t count = count_tris(&mesh, root, &mesh_depth, meshes);
+            it = meshes.emplace(root, std::make_pair(count, mesh_depth)).first;
+        }
+        *maxdepth = std::max(*maxdepth, depth + it->second.second);
+        return it->second.first;
+    }
+    if (bvh_is_leaf(child))
+        return bvh_leaf_count(child);
+    BVH::Node* n = &bvh->nodes[child];
+    size_t count = 0;
+    for (int j = 0; j < BVH_ARITY; j++) {
+        if (n->children[j] != BVH_EMPTY_CHILD)
+            count += count_tris(bvh, n->children[j], maxdepth, meshes, depth + 1);
+    }
+    return count;
 }
 
-BVHHost::BVHHost(Model& model, Device* device) {
-    bvh::v2::ThreadPool thread_pool;
-    bvh::v2::ParallelExecutor executor(thread_pool);
+static float half_area(const BBox& box) {
+    vec3 d = box.max - box.min;
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+static BBox node_box(const BVH::Node& n) {
+    return BBox { n.origin, n.origin + n.scale * (float) BVH_QUANTIZATION_STEPS };
+}
+
+// SAH cost of a subtree, not yet divided by the area of the root: visiting a node and testing a primitive both cost 1.
+// Entering an instance costs 1 plus the cost of the tree of its mesh, which is only computed once per mesh.
+static float compute_sah(BVH* bvh, uint32_t child, const BBox& box, std::unordered_map<uint32_t, float>& mesh_costs) {
+    if (bvh_is_leaf(child) && bvh->instances) {
+        uint32_t root = bvh->instances[bvh_leaf_start(child)].root;
+        auto it = mesh_costs.find(root);
+        if (it == mesh_costs.end()) {
+            BVH mesh = *bvh;
+            mesh.instances = nullptr;
+            BBox mesh_box = node_box(bvh->nodes[root]);
+            it = mesh_costs.emplace(root, compute_sah(&mesh, root, mesh_box, mesh_costs) / half_area(mesh_box)).first;
+        }
+        return half_area(box) * (1 + it->second);
+    }
+    if (bvh_is_leaf(child))
+        return half_area(box) * bvh_leaf_count(child);
+    BVH::Node* n = &bvh->nodes[child];
+    float cost = half_area(box);
+    for (int j = 0; j < BVH_ARITY; j++) {
+        if (n->children[j] != BVH_EMPTY_CHILD)
+            cost += compute_sah(bvh, n->children[j], n->get_child_box(j), mesh_costs);
+    }
+    return cost;
+}
+
+// A part of a triangle with its own bounding box, several of them can point to the same triangle
+struct Reference {
+    BBBox box;
+    int tri;
+};
+
+// Bounds of the part of `tri` that lies inside `box` on one side of the plane at `pos` along `axis`
+static BBBox clip_reference(const BTri& tri, const BBBox& box, int axis, Scalar pos, bool below) {
+    const Vec3 points[3] = { tri.p0, tri.p1, tri.p2 };
+    BBBox clipped = BBBox::make_empty();
+    for (int i = 0; i < 3; i++) {
+        const Vec3& a = points[i];
+        const Vec3& b = points[(i + 1) % 3];
+        bool a_inside = below ? a[axis] <= pos : a[axis] >= pos;
+        bool b_inside = below ? b[axis] <= pos : b[axis] >= pos;
+        if (a_inside)
+            clipped.extend(a);
+        if (a_inside != b_inside) {
+            Scalar t = (pos - a[axis]) / (b[axis] - a[axis]);
+            Vec3 p;
+            for (int k = 0; k < 3; k++)
+                p[k] = a[k] + (b[k] - a[k]) * t;
+            p[axis] = pos;
+            clipped.extend(p);
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        clipped.min[k] = std::max(clipped.min[k], box.min[k]);
+        clipped.max[k] = std::min(clipped.max[k], box.max[k]);
+    }
+    return clipped;
+}
+
+static bool is_empty(const BBBox& box) {
+    return box.min[0] > box.max[0] || box.min[1] > box.max[1] || box.min[2] > box.max[2];
+}
+
+// Pre-splits the references with the largest boxes, halving them along their largest axis until the budget of extra
+// references is used up. This is a cheaper stand-in for the spatial splits of an SBVH builder, the regular
+// object-split builder then runs over the references.
+static std::vector<Reference> split_references(const std::vector<BTri>& tris, float budget) {
+    std::vector<Reference> refs;
+    for (int i = 0; i < tris.size(); i++)
+        refs.push_back(Reference { tris[i].get_bbox(), i });
+
+    auto smaller = [&](int a, int b) { return refs[a].box.get_half_area() < refs[b].box.get_half_area(); };
+    std::vector<int> heap(refs.size());
+    for (int i = 0; i < refs.size(); i++)
+        heap[i] = i;
+    std::make_heap(heap.begin(), heap.end(), smaller);
+
+    size_t max_refs = tris.size() + (size_t) (tris.size() * budget);
+    while (refs.size() < max_refs && !heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), smaller);
+        int i = heap.back();
+        heap.pop_back();
+
+        Reference ref = refs[i];
+        auto extent = ref.box.get_diagonal();
+        int axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+        Scalar pos = (ref.box.min[axis] + ref.box.max[axis]) * 0.5f;
+        BBBox below = clip_reference(tris[ref.tri], ref.box, axis, pos, true);
+        BBBox above = clip_reference(tris[ref.tri], ref.box, axis, pos, false);
+        // Halving a box without tightening it only adds overlap, such references are left alone from now on
+        if (is_empty(below) || is_empty(above) || below.get_half_area() + above.get_half_area() >= ref.box.get_half_area())
+            continue;
+
+        refs[i].box = below;
+        heap.push_back(i);
+        std::push_heap(heap.begin(), heap.end(), smaller);
+        refs.push_back(Reference { above, ref.tri });
+        heap.push_back(refs.size() - 1);
+        std::push_heap(heap.begin(), heap.end(), smaller);
+    }
+    return refs;
+}
+
+// Sets up the quantization grid of a node so that origin + BVH_QUANTIZATION_STEPS * scale covers the whole box
+static void set_quantization_grid(BVH::Node& n, const BBBox& box) {
+    for (int axis = 0; axis < 3; axis++) {
+        float min = box.min[axis];
+        float max = box.max[axis];
+        float scale = (max - min) / BVH_QUANTIZATION_STEPS;
+        while (min + BVH_QUANTIZATION_STEPS * scale < max)
+            scale = nextafterf(scale, INFINITY);
+        n.origin.arr[axis] = min;
+        n.scale.arr[axis] = scale;
+    }
+}
+
+// Quantizes a child box conservatively, the decoded box always contains the original one
+static void quantize_child_box(BVH::Node& n, int i, const BBBox& box) {
+    uint32_t qmin = 0, qmax = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        float origin = n.origin.arr[axis];
+        float scale = n.scale.arr[axis];
+        int lo = 0, hi = 0;
+        if (scale > 0) {
+            lo = std::clamp((int) floorf((box.min[axis] - origin) / scale), 0, BVH_QUANTIZATION_STEPS);
+            hi = std::clamp((int) ceilf((box.max[axis] - origin) / scale), 0, BVH_QUANTIZATION_STEPS);
+            while (lo > 0 && origin + lo * scale > box.min[axis])
+                lo--;
+            while (hi < BVH_QUANTIZATION_STEPS && origin + hi * scale < box.max[axis])
+                hi++;
+        }
+        qmin |= (uint32_t) lo << (axis * 8);
+        qmax |= (uint32_t) hi << (axis * 8);
+    }
+    n.child_min[i] = qmin;
+    n.child_max[i] = qmax;
+}
+
+// Converts the bvh::v2 subtree rooted at `old` into our format and returns a reference to it. For wider arities, the
+// binary tree is collapsed by repeatedly opening the inner child with the largest surface area until the node is full.
+// The root is always turned into an inner node, so that there is at least one node to upload.
+static uint32_t collapse_node(const BBvh& bvh, const BNode& old, BVHNodeArray& nodes, std::vector<int>& indices, bool is_root = false) {
+    if (old.is_leaf() && !is_root) {
+#ifdef BVH_LEAF_BLOCKS
+        // Padding keeps every leaf aligned on a TriangleBlock
+        while (indices.size() % BVH_LEAF_BLOCK_SIZE != 0)
+            indices.push_back(-1);
+#endif
+        uint32_t start = indices.size();
+        uint32_t count = old.index.prim_count();
+        assert(count <= BVH_LEAF_MAX_COUNT && start + count <= BVH_LEAF_START_MASK);
+        for (uint32_t i = 0; i < count; i++)
+            indices.push_back(bvh.prim_ids[old.index.first_id() + i]);
+        return bvh_make_leaf(start, count);
+    }
+
+    uint32_t id = nodes.size();
+    nodes.emplace_back();
+    assert(!bvh_is_leaf(id));
+
+    const BNode* children[BVH_ARITY];
+    int count = 0;
+    if (old.is_leaf()) {
+        children[count++] = &old;
+    } else {
+        children[count++] = &bvh.nodes[old.index.first_id()];
+        children[count++] = &bvh.nodes[old.index.first_id() + 1];
+    }
+    while (count < BVH_ARITY) {
+        int largest = -1;
+        Scalar largest_area = -1;
+        for (int i = 0; i < count; i++) {
+            if (children[i]->is_leaf())
+                continue;
+            Scalar area = children[i]->get_bbox().get_half_area();
+            if (area > largest_area) {
+                largest = i;
+                largest_area = area;
+            }
+        }
+        if (largest < 0)
+            break;
+        const BNode* opened = children[largest];
+        children[largest] = &bvh.nodes[opened->index.first_id()];
+        children[count++] = &bvh.nodes[opened->index.first_id() + 1];
+    }
+
+    // Sort the children along the largest axis of the node, so that occlusion rays can visit them front to back
+    auto box = old.get_bbox();
+    auto extent = box.get_diagonal();
+    uint32_t axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+    std::sort(children, children + count, [&](const BNode* a, const BNode* b) {
+        return a->get_bbox().get_center()[axis] < b->get_bbox().get_center()[axis];
+    });
+
+    BVH::Node n = {};
+    set_quantization_grid(n, box);
+    for (int i = 0; i < BVH_ARITY; i++) {
+        if (i < count) {
+            n.children[i] = collapse_node(bvh, *children[i], nodes, indices);
+            quantize_child_box(n, i, children[i]->get_bbox());
+        } else {
+            n.children[i] = BVH_EMPTY_CHILD;
+        }
+    }
+    n.child_min[0] |= axis << BVH_ORDER_AXIS_SHIFT;
+
+    nodes[id] = n;
+    return id;
+}
+
+// Bump this whenever the layout of the cache file or the way the BVH is built changes
+#define BVH_CACHE_VERSION 6
+
+// The header is padded to a page, so that the nodes that come right after it are on a page of the mapped file too
+struct BVHCacheHeader {
+    char magic[8];
+    uint64_t key;
+    uint32_t root;
+    float scene_min[3];
+    float scene_max[3];
+    uint32_t node_count;
+    uint64_t tri_count;
+    uint64_t index_count;
+    uint64_t block_count;
+    uint64_t instance_count;
+    uint64_t triangle_count;
+    uint64_t sphere_count;
+};
+static_assert(sizeof(BVHCacheHeader) <= BVH_PAGE_BYTES);
+
+static uint64_t fnv_hash64(uint64_t hash, const void* data, size_t size) {
+    auto bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    return hash;
+}
+
+// Everything the cached data depends on: the triangle positions, the builder settings and the memory layout
+static uint64_t cache_key(const Model& model, const BVHBuildConfig& build_config) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    uint32_t layout[] = {
+        BVH_CACHE_VERSION, BVH_ARITY, BVH_LEAF_BLOCK_SIZE,
+        sizeof(BVH::Node), sizeof(TriangleIsect), sizeof(TriangleBlock), sizeof(Instance), sizeof(Sphere),
+#ifdef BVH_REORDER_TRIS
+        1,
+#else
+        0,
+#endif
+#ifdef BVH_LEAF_BLOCKS
+        1,
+#else
+        0,
+#endif
+    };
+    hash = fnv_hash64(hash, layout, sizeof(layout));
+    hash = fnv_hash64(hash, &build_config.split_budget, sizeof(build_config.split_budget));
+    hash = fnv_hash64(hash, &build_config.node_layout, sizeof(build_config.node_layout));
+    hash = fnv_hash64(hash, &build_config.quality, sizeof(build_config.quality));
+    hash = fnv_hash64(hash, &build_config.min_leaf_size, sizeof(build_config.min_leaf_size));
+    hash = fnv_hash64(hash, &build_config.max_leaf_size, sizeof(build_config.max_leaf_size));
+    for (const IndexedTriangle& tri : model.triangles)
+        hash = fnv_hash64(hash, tri.vertices, sizeof(tri.vertices));
+    for (const vec3& position : model.positions)
+        hash = fnv_hash64(hash, &position, sizeof(position));
+    for (const Sphere& sphere : model.spheres)
+        hash = fnv_hash64(hash, &sphere, sizeof(sphere));
+    for (const Mesh& mesh : model.meshes)
+        hash = fnv_hash64(hash, &mesh, sizeof(mesh));
+    for (const Instance& instance : model.instances) {
+        hash = fnv_hash64(hash, &instance.mesh, sizeof(instance.mesh));
+        hash = fnv_hash64(hash, instance.to_world, sizeof(instance.to_world));
+    }
+    return hash;
+}
+
+static const char cache_magic[8] = "RABVHC";
+
+// Points `dst` at the array in the mapped file, which the tree is used from in place, see BVHHost::cache_mapping
+template<typename T>
+static const unsigned char* map_cached_array(const unsigned char* src, const unsigned char* end, T*& dst, size_t count) {
+    if (!src || (size_t) (end - src) < count * sizeof(T) || reinterpret_cast<uintptr_t>(src) % alignof(T) != 0)
+        return nullptr;
+    dst = reinterpret_cast<T*>(const_cast<unsigned char*>(src));
+    return src + count * sizeof(T);
+}
+
+template<typename T>
+static const unsigned char* read_cached_array(const unsigned char* src, const unsigned char* end, std::vector<T>& dst, size_t count) {
+    const T* mapped = nullptr;
+    src = map_cached_array(src, end, mapped, count);
+    if (src)
+        dst.assign(mapped, mapped + count);
+    return src;
+}
+
+template<typename T, typename Allocator>
+static bool write_cached_array(FILE* f, const std::vector<T, Allocator>& src) {
+    return fwrite(src.data(), sizeof(T), src.size(), f) == src.size();
+}
+
+bool BVHHost::load_cache(const char* path, uint64_t key) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < BVH_PAGE_BYTES) {
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    auto data = static_cast<const unsigned char*>(mapping);
+    auto end = data + st.st_size;
+    BVHCacheHeader header;
+    memcpy(&header, data, sizeof(header));
+    const unsigned char* src = nullptr;
+    BVH mapped_bvh = host_bvh;
+    bool valid_root = bvh_is_leaf(header.root) || header.root < header.node_count;
+    if (memcmp(header.magic, cache_magic, sizeof(header.magic)) == 0 && header.key == key && valid_root) {
+        src = data + BVH_PAGE_BYTES;
+        src = map_cached_array(src, end, mapped_bvh.nodes, header.node_count);
+        src = map_cached_array(src, end, mapped_bvh.parents, header.node_count);
+        src = map_cached_array(src, end, mapped_bvh.tris, header.tri_count);
+#ifndef BVH_REORDER_TRIS
+        src = map_cached_array(src, end, mapped_bvh.indices, header.index_count);
+#endif
+#ifdef BVH_LEAF_BLOCKS
+        src = map_cached_array(src, end, mapped_bvh.blocks, header.block_count);
+#endif
+        src = map_cached_array(src, end, mapped_bvh.instances, header.instance_count);
+        // The orders are consumed by `reorder_model` right away
+        src = read_cached_array(src, end, triangle_order, header.triangle_count);
+        src = read_cached_array(src, end, sphere_order, header.sphere_count);
+    }
+
+    if (!src) {
+        munmap(mapping, st.st_size);
+        printf("Ignoring stale BVH cache '%s'\n", path);
+        return false;
+    }
+    unmap_cache();
+    cache_mapping = CacheMapping {
+        .data = mapping,
+        .size = (size_t) st.st_size,
+        .node_count = header.node_count,
+        .tri_count = header.tri_count,
+        .index_count = header.index_count,
+        .block_count = header.block_count,
+        .instance_count = header.instance_count,
+    };
+    host_bvh = mapped_bvh;
+    if (header.instance_count == 0)
+        host_bvh.instances = nullptr;
+    host_bvh.root = header.root;
+    scene_min = vec3(header.scene_min[0], header.scene_min[1], header.scene_min[2]);
+    scene_max = vec3(header.scene_max[0], header.scene_max[1], header.scene_max[2]);
+    printf("Loaded BVH from cache '%s'\n", path);
+    return true;
+}
+
+void BVHHost::save_cache(const char* path, uint64_t key) {
+    BVHCacheHeader header = {};
+    memcpy(header.magic, cache_magic, sizeof(header.magic));
+    header.key = key;
+    header.root = host_bvh.root;
+    for (int axis = 0; axis < 3; axis++) {
+        header.scene_min[axis] = scene_min.arr[axis];
+        header.scene_max[axis] = scene_max.arr[axis];
+    }
+    header.node_count = nodes.size();
+    header.tri_count = isect_tris.size();
+#ifndef BVH_REORDER_TRIS
+    header.index_count = indices.size();
+#endif
+#ifdef BVH_LEAF_BLOCKS
+    header.block_count = blocks.size();
+#endif
+    header.instance_count = instances.size();
+    header.triangle_count = triangle_order.size();
+    header.sphere_count = sphere_order.size();
+
+    // Written next to the final file and renamed, so that concurrent runs never see a partial cache
+    std::string tmp_path = std::string(path) + "." + std::to_string(getpid()) + ".tmp";
+    FILE* f = fopen(tmp_path.c_str(), "wb");
+    if (!f) {
+        printf("Failed to write BVH cache '%s'\n", path);
+        return;
+    }
+    char page[BVH_PAGE_BYTES] = {};
+    memcpy(page, &header, sizeof(header));
+    bool ok = fwrite(page, sizeof(page), 1, f) == 1;
+    ok &= write_cached_array(f, nodes);
+    ok &= write_cached_array(f, parents);
+    ok &= write_cached_array(f, isect_tris);
+#ifndef BVH_REORDER_TRIS
+    ok &= write_cached_array(f, indices);
+#endif
+#ifdef BVH_LEAF_BLOCKS
+    ok &= write_cached_array(f, blocks);
+#endif
+    ok &= write_cached_array(f, instances);
+    ok &= write_cached_array(f, triangle_order);
+    ok &= write_cached_array(f, sphere_order);
+    ok &= fclose(f) == 0;
+    if (!ok || rename(tmp_path.c_str(), path) != 0) {
+        printf("Failed to write BVH cache '%s'\n", path);
+        remove(tmp_path.c_str());
+    }
+}
 
-    std::vector<BTri> input_tris;
-    for (int i = 0; i < model.triangles.size(); i++) {
-        auto& oldtri = model.triangles[i];
+// References to the triangles of a range of the model, split up to the budget
+static std::vector<Reference> make_references(const Model& model, int first, int count, float split_budget) {
+    auto make_tri = [&] (int i) {
+        const IndexedTriangle& indexed = model.triangles[i];
         BTri tri;
-        tri.p0 = nasl2bvh(oldtri.v0);
-        tri.p1 = nasl2bvh(oldtri.v1);
-        tri.p2 = nasl2bvh(oldtri.v2);
-        //printf("Tri: (%f,%f,%f), (%f,%f,%f), (%f,%f,%f)\n", tri.p0[0], tri.p0[1], tri.p0[2], tri.p1[0], tri.p1[1], tri.p1[2], tri.p2[0], tri.p2[1], tri.p2[2]);
-        input_tris.push_back(tri);
+        tri.p0 = nasl2bvh(model.positions[indexed.vertices[0]]);
+        tri.p1 = nasl2bvh(model.positions[indexed.vertices[1]]);
+        tri.p2 = nasl2bvh(model.positions[indexed.vertices[2]]);
+        return tri;
+    };
+
+    std::vector<Reference> refs;
+    if (split_budget > 0) {
+        // Splitting needs the whole triangles, the plain build only their boxes
+        std::vector<BTri> input_tris;
+        for (int i = first; i < first + count; i++)
+            input_tris.push_back(make_tri(i));
+        refs = split_references(input_tris, split_budget);
+        for (Reference& ref : refs)
+            ref.tri += first;
+    } else {
+        refs.reserve(count);
+        for (int i = first; i < first + count; i++)
+            refs.push_back(Reference { make_tri(i).get_bbox(), i });
     }
+    return refs;
+}
 
-    std::vector<BBBox> bboxes(input_tris.size());
-    std::vector<Vec3> centers(input_tris.size());
-    executor.for_each(0, input_tris.size(), [&] (size_t begin, size_t end) {
+// Builds a tree over the references and appends it to `nodes`, with the primitives of its leaves in `indices`
+static uint32_t build_tree(bvh::v2::ThreadPool& thread_pool, const std::vector<Reference>& refs, const BVHBuildConfig& build_config, BVHNodeArray& nodes, std::vector<int>& indices, BBBox& bounds) {
+    bvh::v2::ParallelExecutor executor(thread_pool);
+
+    std::vector<BBBox> bboxes(refs.size());
+    std::vector<Vec3> centers(refs.size());
+    executor.for_each(0, refs.size(), [&] (size_t begin, size_t end) {
         for (size_t i = begin; i < end; ++i) {
-            bboxes[i]  = input_tris[i].get_bbox();
-            centers[i] = input_tris[i].get_center();
+            bboxes[i]  = refs[i].box;
+            centers[i] = refs[i].box.get_center();
         }
     });
 
+    using Quality = bvh::v2::DefaultBuilder<BNode>::Quality;
     typename bvh::v2::DefaultBuilder<BNode>::Config config {  };
-    config.quality = bvh::v2::DefaultBuilder<BNode>::Quality::High;
-    config.min_leaf_size = 4;
-    config.max_leaf_size = 8;
+    config.quality = build_config.quality == BVH_QUALITY_LOW ? Quality::Low : build_config.quality == BVH_QUALITY_MEDIUM ? Quality::Medium : Quality::High;
+    config.max_leaf_size = std::clamp<size_t>(build_config.max_leaf_size, 1, BVH_LEAF_MAX_COUNT);
+    config.min_leaf_size = std::clamp<size_t>(build_config.min_leaf_size, 1, config.max_leaf_size);
     auto bvh = bvh::v2::DefaultBuilder<BNode>::build(thread_pool, bboxes, centers, config);
+    // From here on, the leaves point directly at the triangles
+    for (auto& id : bvh.prim_ids)
+        id = refs[id].tri;
+
+    bounds = bvh.get_root().get_bbox();
+    return collapse_node(bvh, bvh.get_root(), nodes, indices, true);
+}
+
+static BBBox sphere_bbox(const Sphere& sphere) {
+    return BBBox(nasl2bvh(sphere.center - vec3(sphere.radius)), nasl2bvh(sphere.center + vec3(sphere.radius)));
+}
+
+// Builds a tree over the spheres of the model, whose leaves are flagged with BVH_LEAF_SPHERES. Sphere leaves are not
+// padded, so `order` lists the spheres in leaf order and the leaves index the model once it is reordered that way.
+static uint32_t build_sphere_tree(bvh::v2::ThreadPool& thread_pool, const Model& model, const BVHBuildConfig& build_config, BVHNodeArray& nodes, std::vector<int>& order, BBBox& bounds) {
+    std::vector<Reference> refs(model.spheres.size());
+    for (int i = 0; i < model.spheres.size(); i++)
+        refs[i] = Reference { sphere_bbox(model.spheres[i]), i };
+
+    std::vector<int> leaf_indices;
+    uint32_t first_node = nodes.size();
+    uint32_t root = build_tree(thread_pool, refs, build_config, nodes, leaf_indices, bounds);
+
+    std::vector<uint32_t> compact(leaf_indices.size());
+    order.clear();
+    for (int i = 0; i < leaf_indices.size(); i++) {
+        compact[i] = order.size();
+        if (leaf_indices[i] >= 0)
+            order.push_back(leaf_indices[i]);
+    }
+    for (uint32_t id = first_node; id < nodes.size(); id++) {
+        for (uint32_t& child : nodes[id].children) {
+            if (child != BVH_EMPTY_CHILD && bvh_is_leaf(child))
+                child = bvh_make_sphere_leaf(compact[bvh_leaf_start(child)], bvh_leaf_count(child));
+        }
+    }
+    return root;
+}
+
+// Puts two trees under a new root node
+static uint32_t join_trees(BVHNodeArray& nodes, uint32_t a, const BBBox& a_bounds, uint32_t b, const BBBox& b_bounds, BBBox& bounds) {
+    bounds = a_bounds;
+    bounds.extend(b_bounds);
+    auto extent = bounds.get_diagonal();
+    uint32_t axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+    // Sorted along the largest axis, like the nodes made by collapse_node
+    int a_slot = b_bounds.get_center()[axis] < a_bounds.get_center()[axis] ? 1 : 0;
+
+    BVH::Node n = {};
+    set_quantization_grid(n, bounds);
+    for (int i = 0; i < BVH_ARITY; i++)
+        n.children[i] = BVH_EMPTY_CHILD;
+    n.children[a_slot] = a;
+    quantize_child_box(n, a_slot, a_bounds);
+    n.children[1 - a_slot] = b;
+    quantize_child_box(n, 1 - a_slot, b_bounds);
+    n.child_min[0] |= axis << BVH_ORDER_AXIS_SHIFT;
+    nodes.push_back(n);
+    return nodes.size() - 1;
+}
 
-    std::vector<BVH::Node> tmp_nodes;
+// World space bounds of an instance of a mesh with the given object space bounds
+static BBBox instance_bbox(const Instance& instance, const BBBox& box) {
+    BBBox world = BBBox::make_empty();
+    for (int corner = 0; corner < 8; corner++) {
+        vec3 p = instance.to_world[3];
+        for (int axis = 0; axis < 3; axis++)
+            p = p + instance.to_world[axis] * ((corner >> axis) & 1 ? box.max[axis] : box.min[axis]);
+        world.extend(nasl2bvh(p));
+    }
+    return world;
+}
+
+// Triangles in the order the leaves first reference them, each mesh staying in its range. Triangles of meshes that
+// are never instanced keep their order at the end of their range.
+static std::vector<int> leaf_triangle_order(const Model& model, const std::vector<int>& leaf_indices) {
+    std::vector<int> first_use(model.triangles.size(), INT_MAX);
+    for (int i = leaf_indices.size() - 1; i >= 0; i--) {
+        if (leaf_indices[i] >= 0)
+            first_use[leaf_indices[i]] = i;
+    }
+
+    std::vector<Mesh> ranges = model.meshes;
+    if (ranges.empty())
+        ranges.push_back(Mesh { .first_triangle = 0, .triangle_count = (int) model.triangles.size() });
+    std::vector<int> order(model.triangles.size());
+    std::iota(order.begin(), order.end(), 0);
+    for (const Mesh& range : ranges) {
+        auto first = order.begin() + range.first_triangle;
+        std::stable_sort(first, first + range.triangle_count, [&] (int a, int b) { return first_use[a] < first_use[b]; });
+    }
+    return order;
+}
+
+// Milliseconds since `start`, which is moved to now
+static double lap(std::chrono::steady_clock::time_point& start) {
+    auto now = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(now - start).count();
+    start = now;
+    return ms;
+}
+
+static std::vector<uint32_t> tree_roots(const BVH& bvh, size_t node_count, const std::vector<Instance>& instances) {
+    std::vector<uint32_t> roots = { bvh.root };
+    std::vector<uint8_t> is_root(node_count);
+    for (const Instance& instance : instances) {
+        if (!is_root[instance.root])
+            roots.push_back(instance.root);
+        is_root[instance.root] = 1;
+    }
+    return roots;
+}
+
+// Most entries the stack traversals can have pushed while under `id`: at every node on the way down, all the hit
+// children but the one visited next are postponed
+static uint32_t stack_need(const BVHNodeArray& nodes, uint32_t id) {
+    if (bvh_is_leaf(id))
+        return 0;
+    uint32_t children = 0;
+    uint32_t deepest = 0;
+    for (uint32_t child : nodes[id].children) {
+        if (child == BVH_EMPTY_CHILD)
+            continue;
+        children++;
+        deepest = std::max(deepest, stack_need(nodes, child));
+    }
+    return std::max<uint32_t>(children, 1) - 1 + deepest;
+}
+
+// The scalar traversals push without bounds, a tree that is too deep for BVH_STACK_SIZE would overflow their stack.
+// An instanced mesh is traversed above the top level tree and its BVH_INSTANCE_EXIT entry, which
+// BVH_INSTANCE_STACK_SIZE leaves room for as long as each tree fits BVH_STACK_SIZE on its own.
+static void check_stack_size(const BVHNodeArray& nodes, const std::vector<uint32_t>& roots) {
+    for (uint32_t root : roots) {
+        uint32_t need = stack_need(nodes, root);
+        if (need > BVH_STACK_SIZE) {
+            printf("ERROR: BVH traversal needs a stack of %u entries, BVH_STACK_SIZE is %d. Build with larger leaves or a larger BVH_STACK_SIZE.\n", need, BVH_STACK_SIZE);
+            std::abort();
+        }
+    }
+}
+
+void BVHHost::build(const Model& model, const BVHBuildConfig& build_config) {
+    bvh::v2::ThreadPool thread_pool;
+    bvh::v2::ParallelExecutor executor(thread_pool);
+    build_times = {};
+    auto clock = std::chrono::steady_clock::now();
+
+    BVHNodeArray tmp_nodes;
     std::vector<int> tmp_indices;
-    for (auto& old : bvh.nodes) {
-        BVH::Node n = { old.is_leaf() };
-        auto old_box = old.get_bbox();
-        n.box = BBox(bvh2nasl(old_box.min), bvh2nasl(old_box.max));
-        if (old.is_leaf()) {
-            n.leaf.count = 0;
-            n.leaf.start = tmp_indices.size();
-            //printf("Box: (%f,%f,%f), (%f,%f,%f)\n", (float) n.box.min.x, (float) n.box.min.y, (float) n.box.min.z, (float) n.box.max.x, (float) n.box.max.y, (float) n.box.max.z);
-            for (int i = 0; i < old.index.prim_count(); i++) {
-                //tris.push_back(t);
-                auto id = bvh.prim_ids[old.index.first_id() + i];
-                tmp_indices.push_back(id);
-                n.leaf.count += 1;
-                Triangle tri = model.triangles[id];
-                //printf("Tri: (%f,%f,%f), (%f,%f,%f), (%f,%f,%f)\n", tri.v0[0], tri.v0[1], tri.v0[2], tri.v1[0], tri.v1[1], tri.v1[2], tri.v2[0], tri.v2[1], tri.v2[2]);
+    std::vector<Instance> tmp_instances;
+    uint32_t root;
+    BBBox scene_bbox;
+    size_t ref_count = 0;
+    if (model.instances.empty()) {
+        if (!model.triangles.empty()) {
+            auto refs = make_references(model, 0, model.triangles.size(), build_config.split_budget);
+            ref_count = refs.size();
+            build_times.references += lap(clock);
+            root = build_tree(thread_pool, refs, build_config, tmp_nodes, tmp_indices, scene_bbox);
+            build_times.tree += lap(clock);
+        }
+        // Spheres get a subtree of their own, so that every leaf holds a single kind of primitive
+        if (!model.spheres.empty()) {
+            BBBox sphere_bounds;
+            uint32_t sphere_root = build_sphere_tree(thread_pool, model, build_config, tmp_nodes, sphere_order, sphere_bounds);
+            build_times.tree += lap(clock);
+            if (model.triangles.empty()) {
+                root = sphere_root;
+                scene_bbox = sphere_bounds;
+            } else {
+                BBBox triangle_bounds = scene_bbox;
+                root = join_trees(tmp_nodes, root, triangle_bounds, sphere_root, sphere_bounds, scene_bbox);
+            }
+        }
+    } else {
+        // One tree per instanced mesh, with a top level tree over the instances
+        std::vector<uint32_t> mesh_roots(model.meshes.size(), BVH_NO_PARENT);
+        std::vector<BBBox> mesh_bboxes(model.meshes.size());
+        tmp_instances = model.instances;
+        for (Instance& instance : tmp_instances) {
+            int m = instance.mesh;
+            if (mesh_roots[m] == BVH_NO_PARENT) {
+                const Mesh& mesh = model.meshes[m];
+                auto refs = make_references(model, mesh.first_triangle, mesh.triangle_count, build_config.split_budget);
+                ref_count += refs.size();
+                build_times.references += lap(clock);
+                mesh_roots[m] = build_tree(thread_pool, refs, build_config, tmp_nodes, tmp_indices, mesh_bboxes[m]);
+                build_times.tree += lap(clock);
+            }
+            instance.root = mesh_roots[m];
+        }
+
+        std::vector<Reference> instance_refs;
+        for (int i = 0; i < tmp_instances.size(); i++)
+            instance_refs.push_back(Reference { instance_bbox(tmp_instances[i], mesh_bboxes[tmp_instances[i].mesh]), i });
+
+        // Top level leaves hold a single instance and point straight at it, so their indices are not kept
+        std::vector<int> instance_indices;
+        BVHBuildConfig top_config = build_config;
+        top_config.min_leaf_size = top_config.max_leaf_size = 1;
+        uint32_t first_top_node = tmp_nodes.size();
+        build_times.references += lap(clock);
+        root = build_tree(thread_pool, instance_refs, top_config, tmp_nodes, instance_indices, scene_bbox);
+        for (uint32_t id = first_top_node; id < tmp_nodes.size(); id++) {
+            for (uint32_t& child : tmp_nodes[id].children) {
+                if (child == BVH_EMPTY_CHILD || !bvh_is_leaf(child))
+                    continue;
+                assert(bvh_leaf_count(child) == 1);
+                child = bvh_make_leaf(instance_indices[bvh_leaf_start(child)], 1);
             }
-        } else {
-            //printf("Box: (%f,%f,%f), (%f,%f,%f)\n", (float) n.inner.box.min.x, (float) n.inner.box.min.y, (float) n.inner.box.min.z, (float) n.inner.box.max.x, (float) n.inner.box.max.y, (float) n.inner.box.max.z);
-            n.inner.children[0] = ( old.index.first_id());
-            n.inner.children[1] = ( old.index.first_id() + 1);
-            //printf("Inner[%d]: left: %d, right: %d\n", id, n.inner.children[0], n.inner.children[1]);
         }
-        tmp_nodes.push_back(n);
+        build_times.tree += lap(clock);
+    }
+    if (build_config.split_budget > 0)
+        printf("Split %zu triangles into %zu references\n", model.triangles.size(), ref_count);
+
+#ifdef BVH_LEAF_BLOCKS
+    while (tmp_indices.size() % BVH_LEAF_BLOCK_SIZE != 0)
+        tmp_indices.push_back(-1);
+#endif
+
+    // The model is moved into leaf order as well, so shading reads the triangles in about the order they are hit.
+    // From here on, triangles are numbered by their position in that order.
+    triangle_order = leaf_triangle_order(model, tmp_indices);
+    std::vector<int> new_ids(triangle_order.size());
+    for (int i = 0; i < triangle_order.size(); i++)
+        new_ids[triangle_order[i]] = i;
+    for (int& j : tmp_indices) {
+        if (j >= 0)
+            j = new_ids[j];
+    }
+    auto leaf_isect = [&] (int j) {
+        if (j < 0)
+            return make_padding_isect();
+        TriangleIsect tri = make_isect(model, triangle_order[j]);
+        tri.prim_id = j;
+        return tri;
+    };
+
+    std::vector<uint32_t> tmp_parents(tmp_nodes.size(), BVH_NO_PARENT);
+    for (uint32_t id = 0; id < tmp_nodes.size(); id++) {
+        for (uint32_t slot = 0; slot < BVH_ARITY; slot++) {
+            uint32_t child = tmp_nodes[id].children[slot];
+            if (!bvh_is_leaf(child))
+                tmp_parents[child] = (id << BVH_PARENT_SLOT_BITS) | slot;
+        }
     }
 
-    const auto scene_bbox = bvh.get_root().get_bbox();
     scene_min = vec3(scene_bbox.min[0], scene_bbox.min[1], scene_bbox.min[2]);
     scene_max = vec3(scene_bbox.max[0], scene_bbox.max[1], scene_bbox.max[2]);
     
     // This precomputes some data to speed up traversal further.
-    std::vector<Triangle> tmp_reordered_tris(model.triangles.size());
+    // Only the data needed for the intersection tests is kept, in leaf order if BVH_REORDER_TRIS is set.
+#ifdef BVH_REORDER_TRIS
+    std::vector<TriangleIsect> tmp_isect_tris(tmp_indices.size());
+    executor.for_each(0, tmp_indices.size(), [&] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            tmp_isect_tris[i] = leaf_isect(tmp_indices[i]);
+    });
+#else
+    std::vector<TriangleIsect> tmp_isect_tris(model.triangles.size());
     executor.for_each(0, model.triangles.size(), [&] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            tmp_isect_tris[i] = leaf_isect(i);
+    });
+#endif
+
+#ifdef BVH_LEAF_BLOCKS
+    // The host tests whole blocks of leaf primitives at once, see TriangleBlock
+    std::vector<TriangleBlock> tmp_blocks(tmp_indices.size() / BVH_LEAF_BLOCK_SIZE);
+    executor.for_each(0, tmp_blocks.size(), [&] (size_t begin, size_t end) {
         for (size_t i = begin; i < end; ++i) {
-            auto j = true ? tmp_indices[i] : i;
-            tmp_reordered_tris[i] = model.triangles[j];        
+            for (int lane = 0; lane < BVH_LEAF_BLOCK_SIZE; lane++) {
+                TriangleIsect tri = leaf_isect(tmp_indices[i * BVH_LEAF_BLOCK_SIZE + lane]);
+                for (int axis = 0; axis < 3; axis++) {
+                    tmp_blocks[i].v0[axis][lane] = tri.v0.arr[axis];
+                    tmp_blocks[i].e1[axis][lane] = tri.e1.arr[axis];
+                    tmp_blocks[i].e2[axis][lane] = tri.e2.arr[axis];
+                }
+                tmp_blocks[i].prim_id[lane] = tri.prim_id;
+            }
         }
     });
-    
-// #ifdef BVH_REORDER_TRIS
-//     // Ensure the prim ids are still correct
-//     executor.for_each(0, tmp_reordered_tris.size(), [&] (size_t begin, size_t end) {
-//         for (size_t i = begin; i < end; ++i) {
-//             tmp_reordered_tris[i].prim_id = (int)i;        
-//         }
-//     });
-// #endif
+#endif
 
     nodes = std::move(tmp_nodes);
-#ifdef BVH_REORDER_TRIS
-    reordered_tris = std::move(tmp_reordered_tris);
-#else
+    parents = std::move(tmp_parents);
+    isect_tris = std::move(tmp_isect_tris);
+#ifndef BVH_REORDER_TRIS
     indices = std::move(tmp_indices);
 #endif
+#ifdef BVH_LEAF_BLOCKS
+    blocks = std::move(tmp_blocks);
+#endif
+    instances = std::move(tmp_instances);
+    host_bvh.root = root;
+    build_times.primitives += lap(clock);
+    reorder_nodes(build_config.node_layout);
+    build_times.layout += lap(clock);
+    check_stack_size(nodes, tree_roots(host_bvh, nodes.size(), instances));
+}
+
+void BVHHost::reorder_model(Model& model) {
+    model.reorder_triangles(triangle_order);
+    model.reorder_spheres(sphere_order);
+    host_bvh.spheres = model.spheres.empty() ? nullptr : model.spheres.data();
+    gpu_spheres = model.spheres_gpu;
+}
+
+// Roots of all the trees in the node array: the whole scene first, then the meshes if there are instances
+static void depth_first_order(const BVHNodeArray& nodes, uint32_t id, std::vector<uint32_t>& order) {
+    order.push_back(id);
+    for (uint32_t child : nodes[id].children) {
+        if (!bvh_is_leaf(child))
+            depth_first_order(nodes, child, order);
+    }
+}
+
+// Size of the treelets of BVH_LAYOUT_TREELETS
+#define BVH_TREELET_BYTES BVH_PAGE_BYTES
+// Stands for a padding node in a node order, see treelet_order
+#define BVH_PADDING_NODE 0xFFFFFFFFu
+
+static bool is_padding_node(const BVH::Node& n) { return n.children[0] == BVH_EMPTY_CHILD; }
+
+static uint32_t subtree_size(const BVHNodeArray& nodes, uint32_t id, std::vector<uint32_t>& sizes) {
+    sizes[id] = 1;
+    for (uint32_t child : nodes[id].children) {
+        if (!bvh_is_leaf(child))
+            sizes[id] += subtree_size(nodes, child, sizes);
+    }
+    return sizes[id];
+}
+
+// Each treelet grows from its root by taking the node with the largest box among the children of the nodes already
+// in it, until it fills BVH_TREELET_BYTES. The children left over become the roots of the following treelets, which
+// are laid out depth first. Parents always come before their children.
+// No treelet straddles a page of the node array: treelets of small subtrees share a page, and padding nodes move a
+// treelet that does not fit in what is left of the current page to the start of the next one. Pages are counted from
+// the start of the array, which BVHNodeArray allocates on a page, and the node size does not have to divide them.
+static void treelet_order(const BVHNodeArray& nodes, const std::vector<uint32_t>& sizes, uint32_t root, std::vector<uint32_t>& order) {
+    const size_t node_bytes = sizeof(BVH::Node);
+    const size_t treelet_size = std::max<size_t>(1, BVH_TREELET_BYTES / node_bytes);
+    auto area = [&](uint32_t id) { return half_area(node_box(nodes[id])); };
+    auto smaller = [&](uint32_t a, uint32_t b) { return area(a) < area(b); };
+
+    // Pads the next node if it would straddle two pages, then returns how many nodes fit in the rest of its page
+    auto page_room = [&]() {
+        size_t offset = order.size() * node_bytes % BVH_TREELET_BYTES;
+        if (offset + node_bytes > BVH_TREELET_BYTES) {
+            order.push_back(BVH_PADDING_NODE);
+            offset = order.size() * node_bytes % BVH_TREELET_BYTES;
+        }
+        return (BVH_TREELET_BYTES - offset) / node_bytes;
+    };
+
+    std::vector<uint32_t> treelet_roots = { root };
+    std::vector<uint32_t> frontier;
+    while (!treelet_roots.empty()) {
+        frontier.assign(1, treelet_roots.back());
+        treelet_roots.pop_back();
+        size_t size = std::min<size_t>(treelet_size, sizes[frontier[0]]);
+        size_t room = page_room();
+        if (size > room) {
+            order.insert(order.end(), room, BVH_PADDING_NODE);
+            page_room();
+        }
+        for (size_t count = 0; count < size && !frontier.empty(); count++) {
+            std::pop_heap(frontier.begin(), frontier.end(), smaller);
+            uint32_t id = frontier.back();
+            frontier.pop_back();
+            order.push_back(id);
+            for (uint32_t child : nodes[id].children) {
+                if (bvh_is_leaf(child))
+                    continue;
+                frontier.push_back(child);
+                std::push_heap(frontier.begin(), frontier.end(), smaller);
+            }
+        }
+        // The largest of the remaining subtrees is laid out right after this treelet
+        std::sort(frontier.begin(), frontier.end(), smaller);
+        treelet_roots.insert(treelet_roots.end(), frontier.begin(), frontier.end());
+    }
+}
+
+void BVHHost::reorder_nodes(BVHNodeLayout layout) {
+    copy_cache_mapping();
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> sizes(layout == BVH_LAYOUT_TREELETS ? nodes.size() : 0);
+    for (uint32_t root : tree_roots(host_bvh, nodes.size(), instances)) {
+        if (layout == BVH_LAYOUT_TREELETS) {
+            subtree_size(nodes, root, sizes);
+            treelet_order(nodes, sizes, root, order);
+        } else {
+            depth_first_order(nodes, root, order);
+        }
+    }
+    assert(order.size() - std::count(order.begin(), order.end(), BVH_PADDING_NODE) == nodes.size());
+
+    std::vector<uint32_t> new_ids(nodes.size());
+    for (uint32_t i = 0; i < order.size(); i++) {
+        if (order[i] != BVH_PADDING_NODE)
+            new_ids[order[i]] = i;
+    }
 
-    auto root_index = ((&bvh.get_root() - bvh.nodes.data()) / sizeof(*bvh.nodes.data()));
+    // Padding nodes have no children and no parent, nothing ever points to them
+    BVH::Node padding = {};
+    for (uint32_t& child : padding.children)
+        child = BVH_EMPTY_CHILD;
+    BVHNodeArray new_nodes(order.size(), padding);
+    std::vector<uint32_t> new_parents(order.size(), BVH_NO_PARENT);
+    for (uint32_t i = 0; i < order.size(); i++) {
+        if (order[i] == BVH_PADDING_NODE)
+            continue;
+        BVH::Node n = nodes[order[i]];
+        for (uint32_t& child : n.children) {
+            if (!bvh_is_leaf(child))
+                child = new_ids[child];
+        }
+        new_nodes[i] = n;
+        uint32_t parent = parents[order[i]];
+        if (parent != BVH_NO_PARENT)
+            parent = (new_ids[parent >> BVH_PARENT_SLOT_BITS] << BVH_PARENT_SLOT_BITS) | (parent & ((1 << BVH_PARENT_SLOT_BITS) - 1));
+        new_parents[i] = parent;
+    }
 
-    host_bvh.root = (int) root_index;
+    nodes = std::move(new_nodes);
+    parents = std::move(new_parents);
+    host_bvh.root = new_ids[host_bvh.root];
+    for (Instance& instance : instances)
+        instance.root = new_ids[instance.root];
     host_bvh.nodes = nodes.data();
+    host_bvh.parents = parents.data();
+    host_bvh.instances = instances.empty() ? nullptr : instances.data();
+}
+
+BVHHost::BVHHost(Model& model, Device* device, const BVHBuildConfig& build_config) : device(device), config(build_config) {
+    if (build_config.cache_dir) {
+        cache_id = cache_key(model, build_config);
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.bvh", (unsigned long long) cache_id);
+        cache_path = std::string(build_config.cache_dir) + name;
+    }
+
+    bool progressive = false;
+    if (cache_path.empty() || !load_cache(cache_path.c_str(), cache_id)) {
+        progressive = build_config.progressive && build_config.quality != BVH_QUALITY_LOW;
+        BVHBuildConfig first_config = build_config;
+        if (progressive)
+            first_config.quality = BVH_QUALITY_LOW;
+        build(model, first_config);
+        if (!cache_path.empty() && !progressive)
+            save_cache(cache_path.c_str(), cache_id);
+    }
+    reorder_model(model);
+    // The final tree is cached relative to the order the model was loaded in, which needs the order of this one
+    if (!progressive || cache_path.empty()) {
+        release(triangle_order);
+        release(sphere_order);
+    }
+
+    upload();
+    built_sah = sah_cost();
+
+    int maxdepth = 0;
+    std::unordered_map<uint32_t, std::pair<size_t, int>> meshes;
+    size_t c = count_tris(&host_bvh, host_bvh.root, &maxdepth, meshes);
+    size_t node_count = cache_mapping.data ? cache_mapping.node_count : nodes.size();
+    size_t instance_count = cache_mapping.data ? cache_mapping.instance_count : instances.size();
+    printf("BVH is %d nodes long (%zu kb) and at most %d nodes deep.\n", (int) node_count, node_count * sizeof(BVH::Node) / 1024, maxdepth);
+    if (instance_count == 0)
+        assert(c >= model.triangles.size() + model.spheres.size());
+    else
+        printf("BVH has %zu instances, %zu triangles once instanced\n", instance_count, c);
+    printf("BVH SAH cost is %.2f\n", built_sah);
+
+    if (progressive) {
+        printf("Building the final BVH in the background\n");
+        // The model stays in this order until the new tree is swapped in, so it is only read meanwhile
+        background_tree = std::make_unique<BVHHost>(device, build_config);
+        background_build = std::thread([this, &model] {
+            background_tree->build(model, config);
+            background_done = true;
+        });
+    }
+}
+
+BVHHost::BVHHost(Device* device, const BVHBuildConfig& build_config) : device(device), config(build_config) {}
+
+void BVHHost::rebuild(Model& model, const BVHBuildConfig& build_config) {
+    poll_background_build(model, true);
+    config = build_config;
+    release_upload();
+    unmap_cache();
+    build(model, config);
+    reorder_model(model);
+    release(triangle_order);
+    release(sphere_order);
+    upload();
+    built_sah = sah_cost();
+}
+
+bool BVHHost::poll_background_build(Model& model, bool wait) {
+    if (!background_build.joinable() || (!wait && !background_done))
+        return false;
+    background_build.join();
+    std::unique_ptr<BVHHost> next = std::move(background_tree);
+
+    release_upload();
+    unmap_cache();
+    next->reorder_model(model);
+    if (!cache_path.empty()) {
+        for (int& i : next->triangle_order)
+            i = triangle_order[i];
+        for (int& i : next->sphere_order)
+            i = sphere_order[i];
+        next->save_cache(cache_path.c_str(), cache_id);
+    }
+
+    nodes = std::move(next->nodes);
+    parents = std::move(next->parents);
+    isect_tris = std::move(next->isect_tris);
+#ifndef BVH_REORDER_TRIS
+    indices = std::move(next->indices);
+#endif
+#ifdef BVH_LEAF_BLOCKS
+    blocks = std::move(next->blocks);
+#endif
+    instances = std::move(next->instances);
+    release(triangle_order);
+    release(sphere_order);
+    scene_min = next->scene_min;
+    scene_max = next->scene_max;
+    build_times = next->build_times;
+    BVHTraversal traversal = host_bvh.traversal;
+    host_bvh = next->host_bvh;
+    host_bvh.traversal = traversal;
+    gpu_spheres = next->gpu_spheres;
+
+    upload();
+    float previous_sah = built_sah;
+    built_sah = sah_cost();
+    printf("Swapped in the final BVH, SAH cost went from %.2f to %.2f\n", previous_sah, built_sah);
+    return true;
+}
+
+void BVHHost::release_host_copies() {
+    unmap_cache();
+    release(nodes);
+    release(parents);
+    release(isect_tris);
+#ifndef BVH_REORDER_TRIS
+    release(indices);
+#endif
+#ifdef BVH_LEAF_BLOCKS
+    release(blocks);
+#endif
+    release(instances);
+    host_bvh.nodes = nullptr;
+    host_bvh.parents = nullptr;
+    host_bvh.tris = nullptr;
+#ifndef BVH_REORDER_TRIS
+    host_bvh.indices = nullptr;
+#endif
+    host_bvh.blocks = nullptr;
+    host_bvh.instances = nullptr;
+    host_bvh.spheres = nullptr;
+}
+
+void BVHHost::copy_cache_mapping() {
+    if (!cache_mapping.data)
+        return;
+    nodes.assign(host_bvh.nodes, host_bvh.nodes + cache_mapping.node_count);
+    parents.assign(host_bvh.parents, host_bvh.parents + cache_mapping.node_count);
+    isect_tris.assign(host_bvh.tris, host_bvh.tris + cache_mapping.tri_count);
+#ifndef BVH_REORDER_TRIS
+    indices.assign(host_bvh.indices, host_bvh.indices + cache_mapping.index_count);
+#endif
+#ifdef BVH_LEAF_BLOCKS
+    blocks.assign(host_bvh.blocks, host_bvh.blocks + cache_mapping.block_count);
+#endif
+    if (cache_mapping.instance_count > 0)
+        instances.assign(host_bvh.instances, host_bvh.instances + cache_mapping.instance_count);
+    unmap_cache();
+
+    host_bvh.nodes = nodes.data();
+    host_bvh.parents = parents.data();
+    host_bvh.tris = isect_tris.data();
+#ifndef BVH_REORDER_TRIS
+    host_bvh.indices = indices.data();
+#endif
+#ifdef BVH_LEAF_BLOCKS
+    host_bvh.blocks = blocks.data();
+#endif
+    host_bvh.instances = instances.empty() ? nullptr : instances.data();
+}
+
+void BVHHost::unmap_cache() {
+    if (!cache_mapping.data)
+        return;
+    munmap(cache_mapping.data, cache_mapping.size);
+    cache_mapping = {};
+}
+
+void BVHHost::upload() {
+    // A tree still in the cache mapping is uploaded straight from the file, `host_bvh` already points into it
+    bool mapped = cache_mapping.data != nullptr;
+    if (!mapped) {
+        host_bvh.nodes = nodes.data();
+        host_bvh.parents = parents.data();
+        host_bvh.tris = isect_tris.data();
+#ifndef BVH_REORDER_TRIS
+        host_bvh.indices = indices.data();
+#endif
+#ifdef BVH_LEAF_BLOCKS
+        host_bvh.blocks = blocks.data();
+#endif
+        host_bvh.instances = instances.empty() ? nullptr : instances.data();
+    }
+
+    offload(device, host_bvh.nodes, mapped ? cache_mapping.node_count : nodes.size(), gpu_nodes);
+    offload(device, host_bvh.parents, mapped ? cache_mapping.node_count : parents.size(), gpu_parents);
+    offload(device, host_bvh.tris, mapped ? cache_mapping.tri_count : isect_tris.size(), gpu_isect_tris);
+#ifndef BVH_REORDER_TRIS
+    offload(device, host_bvh.indices, mapped ? cache_mapping.index_count : indices.size(), gpu_indices);
+#endif
+    if (host_bvh.instances)
+        offload(device, host_bvh.instances, mapped ? cache_mapping.instance_count : instances.size(), gpu_instances);
+
+    gpu_bvh = host_bvh;
+    gpu_bvh.blocks = nullptr;
+    gpu_bvh.nodes = reinterpret_cast<BVH::Node*>(shd_rn_get_buffer_device_pointer(gpu_nodes));
+    gpu_bvh.parents = reinterpret_cast<uint32_t*>(shd_rn_get_buffer_device_pointer(gpu_parents));
+    gpu_bvh.tris = reinterpret_cast<TriangleIsect*>(shd_rn_get_buffer_device_pointer(gpu_isect_tris));
+#ifndef BVH_REORDER_TRIS
+    gpu_bvh.indices = reinterpret_cast<int*>(shd_rn_get_buffer_device_pointer(gpu_indices));
+#endif
+    if (gpu_instances)
+        gpu_bvh.instances = reinterpret_cast<Instance*>(shd_rn_get_buffer_device_pointer(gpu_instances));
+    if (gpu_spheres)
+        gpu_bvh.spheres = reinterpret_cast<Sphere*>(shd_rn_get_buffer_device_pointer(gpu_spheres));
+}
+
+void BVHHost::release_upload() {
+    shd_rn_destroy_buffer(gpu_isect_tris);
+#ifndef BVH_REORDER_TRIS
+    shd_rn_destroy_buffer(gpu_indices);
+    gpu_indices = nullptr;
+#endif
+    shd_rn_destroy_buffer(gpu_parents);
+    shd_rn_destroy_buffer(gpu_nodes);
+    if (gpu_instances)
+        shd_rn_destroy_buffer(gpu_instances);
+    gpu_instances = nullptr;
+    gpu_isect_tris = nullptr;
+    gpu_parents = nullptr;
+    gpu_nodes = nullptr;
+}
+
+// SAH cost of the whole tree relative to the area of the scene bounds
+float BVHHost::sah_cost() {
+    std::unordered_map<uint32_t, float> mesh_costs;
+    BBox root_box = node_box(host_bvh.nodes[host_bvh.root]);
+    return compute_sah(&host_bvh, host_bvh.root, root_box, mesh_costs) / half_area(root_box);
+}
+
+void BVHHost::print_report() {
+    copy_cache_mapping();
+    // The leaves of the top level tree hold one instance each, only the trees of the meshes are looked at
+    std::vector<uint8_t> is_top(nodes.size());
+    if (!instances.empty()) {
+        std::vector<uint32_t> stack = { host_bvh.root };
+        while (!stack.empty()) {
+            uint32_t id = stack.back();
+            stack.pop_back();
+            is_top[id] = 1;
+            for (uint32_t child : nodes[id].children) {
+                if (!bvh_is_leaf(child))
+                    stack.push_back(child);
+            }
+        }
+    }
+
+    size_t leaf_sizes[BVH_LEAF_MAX_COUNT + 1] = {};
+    size_t inner_count = 0, leaf_count = 0, prim_count = 0;
+    // Sum over the nodes of the area shared by each pair of children, relative to the area of the node
+    double overlap = 0;
+    for (uint32_t id = 0; id < nodes.size(); id++) {
+        if (is_top[id] || is_padding_node(nodes[id]))
+            continue;
+        const BVH::Node& n = nodes[id];
+        BBox boxes[BVH_ARITY];
+        int count = 0;
+        for (int j = 0; j < BVH_ARITY; j++) {
+            uint32_t child = n.children[j];
+            if (child == BVH_EMPTY_CHILD)
+                continue;
+            boxes[count++] = n.get_child_box(j);
+            if (bvh_is_leaf(child)) {
+                leaf_sizes[bvh_leaf_count(child)]++;
+                leaf_count++;
+                prim_count += bvh_leaf_count(child);
+            }
+        }
+        inner_count++;
+
+        float shared = 0;
+        for (int a = 0; a < count; a++) {
+            for (int b = a + 1; b < count; b++) {
+                BBox both;
+                for (int axis = 0; axis < 3; axis++) {
+                    both.min.arr[axis] = fmaxf(boxes[a].min.arr[axis], boxes[b].min.arr[axis]);
+                    both.max.arr[axis] = fminf(boxes[a].max.arr[axis], boxes[b].max.arr[axis]);
+                }
+                if (both.min.x <= both.max.x && both.min.y <= both.max.y && both.min.z <= both.max.z)
+                    shared += half_area(both);
+            }
+        }
+        float area = half_area(node_box(n));
+        if (area > 0)
+            overlap += shared / area;
+    }
+
+    printf("BVH report:\n");
+    printf("  SAH cost: %.2f\n", sah_cost());
+    printf("  %zu inner nodes, %zu leaves with %.2f primitives on average\n", inner_count, leaf_count, leaf_count ? (double) prim_count / leaf_count : 0.0);
+    printf("  Leaf sizes:");
+    for (int i = 0; i <= BVH_LEAF_MAX_COUNT; i++) {
+        if (leaf_sizes[i])
+            printf(" %d: %.1f%%", i, 100.0 * leaf_sizes[i] / leaf_count);
+    }
+    printf("\n");
+    printf("  Sibling overlap: %.3f of the parent area per node\n", inner_count ? overlap / inner_count : 0.0);
+    const BVHBuildTimes& t = build_times;
+    if (t.references + t.tree + t.primitives + t.layout > 0)
+        printf("  Build time: %.1fms references, %.1fms tree, %.1fms primitives, %.1fms layout\n", t.references, t.tree, t.primitives, t.layout);
+    else
+        printf("  Loaded from the cache\n");
+}
+
+// Uploads each run of consecutive dirty elements with a single copy
+template<typename T, typename Allocator>
+static void upload_dirty_ranges(Buffer* dst, const std::vector<T, Allocator>& src, const std::vector<uint8_t>& dirty) {
+    for (size_t i = 0; i < src.size();) {
+        if (!dirty[i]) {
+            i++;
+            continue;
+        }
+        size_t end = i;
+        while (end < src.size() && dirty[end])
+            end++;
+        shd_rn_copy_to_buffer(dst, i * sizeof(T), (void*) &src[i], (end - i) * sizeof(T));
+        i = end;
+    }
+}
+
+static void extend(BBBox& box, const TriangleIsect& tri) {
+    box.extend(nasl2bvh(tri.v0));
+    box.extend(nasl2bvh(tri.v0 + tri.e1));
+    box.extend(nasl2bvh(tri.v0 + tri.e2));
+}
+
+bool BVHHost::refit(Model& model) {
+    poll_background_build(model, true);
+    copy_cache_mapping();
+
+    bvh::v2::ThreadPool thread_pool;
+    bvh::v2::ParallelExecutor executor(thread_pool);
+
+    // Recompute the intersection data first, the leaf bounds are taken from it
+    std::vector<uint8_t> dirty_tris(isect_tris.size());
+    executor.for_each(0, isect_tris.size(), [&] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
 #ifdef BVH_REORDER_TRIS
-    host_bvh.tris = reordered_tris.data();
+            // Triangles are numbered by their position in the model, see Model::Model
+            int j = isect_tris[i].prim_id;
 #else
-    host_bvh.indices = indices.data();
+            int j = i;
 #endif
+            if (j < 0)
+                continue;
+            TriangleIsect tri = make_isect(model, j);
+            if (memcmp(&tri, &isect_tris[i], sizeof(tri)) != 0) {
+                isect_tris[i] = tri;
+                dirty_tris[i] = 1;
+            }
+        }
+    });
 
-    offload(device, nodes, gpu_nodes);
+    // Only the vertices of triangles that moved can have moved, as far as shading is concerned
+    std::vector<uint8_t> dirty_positions(model.positions.size());
+    for (size_t i = 0; i < isect_tris.size(); i++) {
+        if (!dirty_tris[i])
+            continue;
 #ifdef BVH_REORDER_TRIS
-    offload(device, reordered_tris, gpu_reordered_tris);
+        int j = isect_tris[i].prim_id;
 #else
-    offload(device, indices, gpu_indices);
+        int j = i;
 #endif
+        for (int vertex : model.triangles[j].vertices)
+            dirty_positions[vertex] = 1;
+    }
 
-    gpu_bvh = host_bvh;
-    gpu_bvh.nodes = reinterpret_cast<BVH::Node*>(shd_rn_get_buffer_device_pointer(gpu_nodes));
+#ifdef BVH_LEAF_BLOCKS
+    executor.for_each(0, blocks.size(), [&] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            for (int lane = 0; lane < BVH_LEAF_BLOCK_SIZE; lane++) {
 #ifdef BVH_REORDER_TRIS
-    gpu_bvh.tris = reinterpret_cast<Triangle*>(shd_rn_get_buffer_device_pointer(gpu_reordered_tris));
+                TriangleIsect tri = isect_tris[i * BVH_LEAF_BLOCK_SIZE + lane];
 #else
-    gpu_bvh.tris = reinterpret_cast<Triangle*>(shd_rn_get_buffer_device_pointer(model.triangles_gpu));
-    gpu_bvh.indices = reinterpret_cast<int*>(shd_rn_get_buffer_device_pointer(gpu_indices));
+                auto j = indices[i * BVH_LEAF_BLOCK_SIZE + lane];
+                TriangleIsect tri = j >= 0 ? isect_tris[j] : make_padding_isect();
+#endif
+                for (int axis = 0; axis < 3; axis++) {
+                    blocks[i].v0[axis][lane] = tri.v0.arr[axis];
+                    blocks[i].e1[axis][lane] = tri.e1.arr[axis];
+                    blocks[i].e2[axis][lane] = tri.e2.arr[axis];
+                }
+            }
+        }
+    });
 #endif
 
-    int maxdepth = 0;
-    int c = count_tris(&host_bvh, host_bvh.root, &maxdepth);
-    printf("BVH is %d nodes long and at most %d nodes deep.\n", (int) nodes.size(), maxdepth);
-    assert(c == model.triangles.size());
-}
+    // Instances may have moved as well, their meshes keep the same trees
+    std::vector<uint8_t> dirty_instances(instances.size());
+    for (size_t i = 0; i < instances.size(); i++) {
+        Instance instance = model.instances[i];
+        instance.root = instances[i].root;
+        if (memcmp(&instance, &instances[i], sizeof(instance)) != 0) {
+            instances[i] = instance;
+            dirty_instances[i] = 1;
+        }
+    }
 
-BVHHost::~BVHHost() {
+    // Parents are always created before their children, so a single pass gives the depth of every node. The nodes of
+    // the top level tree are refitted after all the meshes, they are put in levels of their own.
+    std::vector<uint8_t> is_top(nodes.size(), instances.empty() ? 0 : 1);
+    if (!instances.empty()) {
+        for (const Instance& instance : instances)
+            is_top[instance.root] = 0;
+    }
+    std::vector<uint32_t> depths(nodes.size(), 0);
+    std::vector<std::vector<uint32_t>> levels, top_levels;
+    for (uint32_t id = 0; id < nodes.size(); id++) {
+        if (is_padding_node(nodes[id]))
+            continue;
+        if (parents[id] != BVH_NO_PARENT) {
+            uint32_t parent = parents[id] >> BVH_PARENT_SLOT_BITS;
+            depths[id] = depths[parent] + 1;
+            is_top[id] = is_top[parent];
+        }
+        auto& node_levels = is_top[id] ? top_levels : levels;
+        if (depths[id] >= node_levels.size())
+            node_levels.resize(depths[id] + 1);
+        node_levels[depths[id]].push_back(id);
+    }
+    std::reverse(levels.begin(), levels.end());
+    std::reverse(top_levels.begin(), top_levels.end());
+    levels.insert(levels.end(), top_levels.begin(), top_levels.end());
+
+    // Bottom-up, every node of a level only depends on the exact bounds of the levels before it
+    std::vector<BBBox> node_boxes(nodes.size());
+    std::vector<uint8_t> dirty_nodes(nodes.size());
+    for (const std::vector<uint32_t>& level : levels) {
+        executor.for_each(0, level.size(), [&] (size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                uint32_t id = level[i];
+                BVH::Node n = nodes[id];
+                BBBox child_boxes[BVH_ARITY];
+                BBBox box = BBBox::make_empty();
+                for (int j = 0; j < BVH_ARITY; j++) {
+                    uint32_t child = n.children[j];
+                    if (child == BVH_EMPTY_CHILD)
+                        continue;
+                    if (bvh_is_leaf(child) && is_top[id]) {
+                        const Instance& instance = instances[bvh_leaf_start(child)];
+                        child_boxes[j] = instance_bbox(instance, node_boxes[instance.root]);
+                    } else if (bvh_is_leaf(child) && bvh_leaf_is_spheres(child)) {
+                        child_boxes[j] = BBBox::make_empty();
+                        for (uint32_t k = 0; k < bvh_leaf_count(child); k++)
+                            child_boxes[j].extend(sphere_bbox(model.spheres[bvh_leaf_start(child) + k]));
+                    } else if (bvh_is_leaf(child)) {
+                        child_boxes[j] = BBBox::make_empty();
+                        uint32_t start = bvh_leaf_start(child);
+                        for (uint32_t k = 0; k < bvh_leaf_count(child); k++) {
 #ifdef BVH_REORDER_TRIS
-    shd_rn_destroy_buffer(gpu_reordered_tris);
+                            extend(child_boxes[j], isect_tris[start + k]);
 #else
-    shd_rn_destroy_buffer(gpu_indices);
+                            extend(child_boxes[j], isect_tris[indices[start + k]]);
 #endif
-    shd_rn_destroy_buffer(gpu_nodes);
+                        }
+                    } else {
+                        child_boxes[j] = node_boxes[child];
+                    }
+                    box.extend(child_boxes[j]);
+                }
+
+                // The child order is kept, it may no longer be sorted along the axis but any order is correct
+                uint32_t axis = n.get_order_axis();
+                set_quantization_grid(n, box);
+                for (int j = 0; j < BVH_ARITY; j++) {
+                    if (n.children[j] != BVH_EMPTY_CHILD)
+                        quantize_child_box(n, j, child_boxes[j]);
+                }
+                n.child_min[0] |= axis << BVH_ORDER_AXIS_SHIFT;
+
+                node_boxes[id] = box;
+                if (memcmp(&n, &nodes[id], sizeof(n)) != 0) {
+                    nodes[id] = n;
+                    dirty_nodes[id] = 1;
+                }
+            }
+        });
+    }
+
+    const BBBox& scene_bbox = node_boxes[host_bvh.root];
+    scene_min = vec3(scene_bbox.min[0], scene_bbox.min[1], scene_bbox.min[2]);
+    scene_max = vec3(scene_bbox.max[0], scene_bbox.max[1], scene_bbox.max[2]);
+
+    // Emitters that moved changed their normal and area, which the alias table and the MIS weights depend on
+    model.build_emitter_table();
+
+    float sah = sah_cost();
+    bool rebuilt = sah > built_sah * config.rebuild_threshold;
+    if (rebuilt) {
+        // Rebuilding reorders the model, which uploads its geometry and emitters again
+        printf("BVH SAH cost went from %.2f to %.2f after refitting, rebuilding\n", built_sah, sah);
+        rebuild(model, config);
+        printf("BVH SAH cost is %.2f\n", built_sah);
+    } else {
+        upload_dirty_ranges(gpu_nodes, nodes, dirty_nodes);
+        upload_dirty_ranges(gpu_isect_tris, isect_tris, dirty_tris);
+        if (gpu_instances)
+            upload_dirty_ranges(gpu_instances, instances, dirty_instances);
+        upload_dirty_ranges(model.positions_gpu, model.positions, dirty_positions);
+        // The spheres are refitted in place, the model's copy on the device is updated with them
+        if (gpu_spheres)
+            shd_rn_copy_to_buffer(gpu_spheres, 0, model.spheres.data(), model.spheres.size() * sizeof(Sphere));
+        shd_rn_copy_to_buffer(model.emitters_gpu, 0, model.emitters.data(), model.emitters.size() * sizeof(Emitter));
+    }
+    shd_rn_copy_to_buffer(model.materials_gpu, 0, model.materials.data(), model.materials.size() * sizeof(Material));
+    return rebuilt;
+}
+
+BVHHost::~BVHHost() {
+    if (background_build.joinable())
+        background_build.join();
+    if (gpu_nodes)
+        release_upload();
+    unmap_cache();
 }
\ No newline at end of file
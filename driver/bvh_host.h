@@ -2,26 +2,160 @@
 #include "bvh.h"
 #include "model.h"
 
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+// Strategies of the bvh::v2 builder
+enum BVHBuildQuality {
+    // Binned SAH, several times faster to build for a somewhat more expensive tree
+    BVH_QUALITY_LOW,
+    // Binned SAH over small clusters of primitives, reinserted by the full sweep at the top
+    BVH_QUALITY_MEDIUM,
+    // Full sweep SAH
+    BVH_QUALITY_HIGH,
+};
+
+// Treelets of BVH_LAYOUT_TREELETS are a page each, the node array starts on a page for them to line up with memory
+#define BVH_PAGE_BYTES 4096
+using BVHNodeArray = std::vector<BVH::Node, AlignedAllocator<BVH::Node, BVH_PAGE_BYTES>>;
+
+enum BVHNodeLayout {
+    // Nodes in the order of a depth-first traversal, as they come out of the builder
+    BVH_LAYOUT_DEPTH_FIRST,
+    // Subtrees are packed into page sized treelets, starting with the nodes with the largest boxes, which are the most
+    // likely to be visited. The top of the tree ends up in the first few pages. Padding nodes keep every treelet
+    // within one page.
+    BVH_LAYOUT_TREELETS,
+};
+
+struct BVHBuildConfig {
+    // Long triangles get split into several references with tighter boxes before the build, up to this many extra
+    // references per triangle on average. 0 builds over whole triangles.
+    float split_budget = 0;
+    // If set, the finished BVH is kept in this directory and reused by later runs on the same model and settings
+    const char* cache_dir = nullptr;
+    // BVHHost::refit rebuilds from scratch once the SAH cost grows past this factor of the cost right after the build
+    float rebuild_threshold = 1.5f;
+    BVHNodeLayout node_layout = BVH_LAYOUT_TREELETS;
+    BVHBuildQuality quality = BVH_QUALITY_HIGH;
+    // The builder stops splitting below min_leaf_size primitives and always splits above max_leaf_size, which can't be
+    // more than BVH_LEAF_MAX_COUNT. Applies to triangles and spheres, instances always get a leaf each.
+    int min_leaf_size = 4;
+    int max_leaf_size = 8;
+    // Starts with a BVH_QUALITY_LOW tree and builds the tree of `quality` on a background thread, see
+    // BVHHost::poll_background_build. Only the final tree goes into the cache.
+    bool progressive = false;
+};
+
+// Milliseconds spent in each phase of a build
+struct BVHBuildTimes {
+    // Gathering and splitting the boxes of the primitives
+    double references = 0;
+    // The bvh::v2 builds and collapsing their trees to BVH_ARITY
+    double tree = 0;
+    // Moving the primitives into leaf order
+    double primitives = 0;
+    // Laying out the nodes, see BVHNodeLayout
+    double layout = 0;
+};
+
 struct BVHHost {
-    BVHHost(Model&, shady::Device*);
+    BVHHost(Model&, shady::Device*, const BVHBuildConfig& config = {});
+    // Empty host, to build a tree without uploading it or touching the model
+    BVHHost(shady::Device*, const BVHBuildConfig& config);
     ~BVHHost();
 
-    std::vector<BVH::Node> nodes;
-#ifdef BVH_REORDER_TRIS
-    std::vector<Triangle> reordered_tris;
-#else
+    // Builds the tree over the model as it is, the model has to be moved into `triangle_order` and `sphere_order` with
+    // `reorder_model` before it can be traced.
+    void build(const Model&, const BVHBuildConfig& config);
+    void reorder_model(Model&);
+    // Builds the tree again with other settings, without the cache, and uploads it in place of the current one
+    void rebuild(Model&, const BVHBuildConfig& config);
+    // Maps the cache file and points `host_bvh` into it, see `cache_mapping`
+    bool load_cache(const char* path, uint64_t key);
+    void save_cache(const char* path, uint64_t key);
+    // Only moves the nodes around in memory, `upload` has to be called again if they were uploaded already
+    void reorder_nodes(BVHNodeLayout layout);
+    // Fills the host arrays from the cache mapping and unmaps it, does nothing if the tree is not mapped
+    void copy_cache_mapping();
+    void unmap_cache();
+    void upload();
+    void release_upload();
+    // Frees the host side of the tree once it has been uploaded, after which only `gpu_bvh` can be traced
+    void release_host_copies();
+    float sah_cost();
+    // Prints the SAH cost, the leaf sizes, how much sibling boxes overlap and how long the build took
+    void print_report();
+    // Swaps in the tree of a progressive build once it is done, or waits for it with `wait`. To be called between
+    // frames. Returns true if it did, in which case the model was reordered and `host_bvh` and `gpu_bvh` are new.
+    bool poll_background_build(Model&, bool wait = false);
+    bool building_in_background() const { return background_build.joinable(); }
+
+    // Updates the bounds for moved vertices in `Model::positions` and moved `Model::instances`, keeping the topology
+    // of the tree. A progressive build is waited for first. Only the nodes, primitives, instances and model vertices
+    // that changed are uploaded again, along with the emitter table and materials. Returns true if the tree had
+    // degraded too much and was rebuilt, in which case the buffers and `gpu_bvh` are new.
+    bool refit(Model&);
+
+    BVHNodeArray nodes;
+    std::vector<uint32_t> parents;
+    std::vector<TriangleIsect> isect_tris;
+#ifndef BVH_REORDER_TRIS
     std::vector<int> indices;
 #endif
+#ifdef BVH_LEAF_BLOCKS
+    std::vector<TriangleBlock> blocks;
+#endif
+    // Copy of `Model::instances` with the roots of the meshes filled in, empty if the model has no instances
+    std::vector<Instance> instances;
+    // The order the build moved the model's triangles into, see Model::reorder_triangles. Only kept until it is
+    // cached, or until the tree of a progressive build replaces this one.
+    std::vector<int> triangle_order;
+    // Same for Model::reorder_spheres
+    std::vector<int> sphere_order;
 
     vec3 scene_min;
     vec3 scene_max;
 
+    shady::Device* device;
+    BVHBuildConfig config;
+    // SAH cost of the tree as built, refits are compared against it
+    float built_sah = 0;
+    // Of the last build, all 0 when the tree came from the cache
+    BVHBuildTimes build_times;
+
     BVH host_bvh;
     BVH gpu_bvh;
     shady::Buffer* gpu_nodes = nullptr;
-#ifdef BVH_REORDER_TRIS
-    shady::Buffer* gpu_reordered_tris = nullptr;
-#else
+    shady::Buffer* gpu_parents = nullptr;
+    shady::Buffer* gpu_isect_tris = nullptr;
+#ifndef BVH_REORDER_TRIS
     shady::Buffer* gpu_indices = nullptr;
 #endif
+    shady::Buffer* gpu_instances = nullptr;
+    // Owned by the model, which keeps its spheres in the order of the sphere leaves
+    shady::Buffer* gpu_spheres = nullptr;
+
+    // Where the final tree is cached, empty without a cache
+    std::string cache_path;
+    uint64_t cache_id = 0;
+    // A tree loaded by `load_cache` is used in place in the mapped file: the host arrays stay empty and `host_bvh`
+    // points into the file, which `upload` and the CPU traversals read directly. The arrays are only filled by
+    // `copy_cache_mapping`, for the refits and the reports that need them, and `release_host_copies` just unmaps it.
+    struct CacheMapping {
+        void* data = nullptr;
+        size_t size = 0;
+        size_t node_count = 0;
+        size_t tri_count = 0;
+        size_t index_count = 0;
+        size_t block_count = 0;
+        size_t instance_count = 0;
+    } cache_mapping;
+
+    // Progressive builds, see BVHBuildConfig::progressive
+    std::thread background_build;
+    std::atomic<bool> background_done = false;
+    std::unique_ptr<BVHHost> background_tree;
 };
\ No newline at end of file
@@ -1,6 +1,8 @@
 #ifndef RA_HOST_H
 #define RA_HOST_H
 
+#include <new>
+
 namespace shady {
 extern "C" {
 
@@ -10,11 +12,39 @@ extern "C" {
 }
 
 template<typename T>
-void offload(shady::Device* device, const std::vector<T>& src, shady::Buffer*& dst) {
+void offload(shady::Device* device, const T* src, size_t count, shady::Buffer*& dst) {
     assert(device);
     assert(!dst);
-    dst = shady::shd_rn_allocate_buffer_device(device, src.size() * sizeof(T));
-    shd_rn_copy_to_buffer(dst, 0, (void*) src.data(), src.size() * sizeof(T));
+    dst = shady::shd_rn_allocate_buffer_device(device, count * sizeof(T));
+    shd_rn_copy_to_buffer(dst, 0, (void*) src, count * sizeof(T));
+}
+
+template<typename T>
+void offload(shady::Device* device, const std::vector<T>& src, shady::Buffer*& dst) {
+    offload(device, src.data(), src.size(), dst);
 }
 
+// Frees the memory of a vector, which clear() keeps
+template<typename T, typename Allocator>
+void release(std::vector<T, Allocator>& v) {
+    std::vector<T, Allocator>().swap(v);
+}
+
+// Allocates on boundaries of `Alignment` bytes, which operator new only does up to alignof(std::max_align_t)
+template<typename T, size_t Alignment>
+struct AlignedAllocator {
+    using value_type = T;
+    template<typename U>
+    struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+    AlignedAllocator() = default;
+    template<typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(size_t count) { return static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t(Alignment))); }
+    void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(Alignment)); }
+    template<typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+};
+
 #endif
@@ -3,6 +3,8 @@
 #include <cmath>
 #include <array>
 #include <vector>
+#include <algorithm>
+#include <numeric>
 #include <optional>
 
 #include <cstdint>
@@ -28,9 +30,19 @@ bool read_file(const char* filename, size_t* size, char** output);
 }
 
 #include "renderer.h"
+#include "packet.h"
+#include "stream.h"
 
 #include "model.h"
 #include "bvh_host.h"
+#include "wavefront_host.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 // static_assert(sizeof(Sphere) == sizeof(float) * 4);
 
@@ -62,6 +74,23 @@ static auto time() -> uint64_t {
 }
 #endif
 
+// Counts the hardware cache misses of this thread and the threads it starts, returns -1 if that is not allowed
+static int open_cache_miss_counter() {
+#ifdef __linux__
+    perf_event_attr attr = {};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
 #define xstr(s) str(s)
 #define str(s) #s
 
@@ -86,16 +115,28 @@ extern "C" {
 
 thread_local vec2 gl_GlobalInvocationID;
 RA_RENDERER_SIGNATURE;
+RA_PACKET_RENDERER_SIGNATURE;
+RA_STREAM_RENDERER_SIGNATURE;
 }
 
 bool headless = false;
 bool gpu = true;
+// Whether the scene stays on the host, so that the CPU can render it. Cleared as soon as the host copies are due to be
+// released, even if a progressive build still needs them for a while.
+bool host_copies = true;
 bool cuda = false;
 bool use_bvh = true;
+bool use_packets = true;
+bool use_stream = false;
+bool use_wavefront = false;
+// Shade the hits of each bounce grouped by material, in the stream and wavefront renderers
+bool sort_materials = true;
 RenderMode render_mode = DEFAULT_RENDER_MODE;
 
 int max_frames = 0;
 int nframe = 0, accum = 0;
+// By the stream renderer, the wavefront renderer counts its own
+uint64_t rays_traced = 0;
 int runs = 1;
 
 bool screenshotRequested = false;
@@ -111,12 +152,31 @@ auto walk_pNext_chain(VkBaseInStructure* s, T t) {
 
 struct CommandArguments {
     int max_depth = 5;
+    // Samples per pixel rendered by each frame, in a single launch
+    int spp_per_launch = 1;
+    // Adaptive sampling, see AdaptiveSampling. Headless runs stop once every pixel is under the target error.
+    float target_error = 0;
+    int min_samples = 16;
     std::optional<float> camera_speed;
     std::optional<vec3> camera_eye;
     std::optional<vec3> camera_dir;
     std::optional<vec3> camera_up;
     std::optional<vec2> camera_rot;
     std::optional<float> camera_fov;
+    BVHTraversal traversal = BVH_TRAVERSAL_STACK;
+    bool bench_traversal = false;
+    bool bench_refit = false;
+    bool bench_layout = false;
+    bool bench_material_sort = false;
+    bool bench_integrator = false;
+    bool bvh_autotune = false;
+    bool bvh_report = false;
+    bool instancing = false;
+    float point_radius = 0;
+    bool keep_host_copies = false;
+    // Restart accumulation when the final tree of a progressive build is swapped in
+    bool progressive_reset = false;
+    BVHBuildConfig bvh_config;
 };
 
 int main(int argc, char** argv) {
@@ -141,6 +201,18 @@ int main(int argc, char** argv) {
             use_bvh = false;
             continue;
         }
+        if (strcmp(argv[i], "--no-packets") == 0) {
+            use_packets = false;
+            continue;
+        }
+        if (strcmp(argv[i], "--stream") == 0) {
+            use_stream = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--wavefront") == 0) {
+            use_wavefront = true;
+            continue;
+        }
         if (strcmp(argv[i], "--cpu") == 0) {
             gpu = false;
             continue;
@@ -158,10 +230,129 @@ int main(int argc, char** argv) {
             HEIGHT = strtol(argv[++i], nullptr, 10);
             continue;
         }
+        if (strcmp(argv[i], "--traversal") == 0) {
+            i++;
+            if (strcmp(argv[i], "stack") == 0)
+                cmd_args.traversal = BVH_TRAVERSAL_STACK;
+            else if (strcmp(argv[i], "stackless") == 0)
+                cmd_args.traversal = BVH_TRAVERSAL_STACKLESS;
+            else {
+                printf("Unknown traversal '%s', expected 'stack' or 'stackless'\n", argv[i]);
+                exit(-1);
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--bench-traversal") == 0) {
+            cmd_args.bench_traversal = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--bench-layout") == 0) {
+            cmd_args.bench_layout = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--bench-material-sort") == 0) {
+            cmd_args.bench_material_sort = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--bench-integrator") == 0) {
+            cmd_args.bench_integrator = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--no-material-sort") == 0) {
+            sort_materials = false;
+            continue;
+        }
+        if (strcmp(argv[i], "--node-layout") == 0) {
+            i++;
+            if (strcmp(argv[i], "dfs") == 0)
+                cmd_args.bvh_config.node_layout = BVH_LAYOUT_DEPTH_FIRST;
+            else if (strcmp(argv[i], "treelets") == 0)
+                cmd_args.bvh_config.node_layout = BVH_LAYOUT_TREELETS;
+            else {
+                printf("Unknown node layout '%s', expected 'dfs' or 'treelets'\n", argv[i]);
+                exit(-1);
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "--bench-refit") == 0) {
+            cmd_args.bench_refit = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--keep-host-copies") == 0) {
+            cmd_args.keep_host_copies = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--instancing") == 0) {
+            cmd_args.instancing = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--point-radius") == 0) {
+            cmd_args.point_radius = strtof(argv[++i], nullptr);
+            continue;
+        }
+        if (strcmp(argv[i], "--spatial-splits") == 0) {
+            cmd_args.bvh_config.split_budget = strtof(argv[++i], nullptr);
+            continue;
+        }
+        if (strcmp(argv[i], "--bvh-quality") == 0) {
+            const char* quality = argv[++i];
+            if (strcmp(quality, "low") == 0)
+                cmd_args.bvh_config.quality = BVH_QUALITY_LOW;
+            else if (strcmp(quality, "medium") == 0)
+                cmd_args.bvh_config.quality = BVH_QUALITY_MEDIUM;
+            else if (strcmp(quality, "high") == 0)
+                cmd_args.bvh_config.quality = BVH_QUALITY_HIGH;
+            else
+                printf("Unknown BVH quality '%s', expected low, medium or high\n", quality);
+            continue;
+        }
+        if (strcmp(argv[i], "--min-leaf-size") == 0) {
+            cmd_args.bvh_config.min_leaf_size = atoi(argv[++i]);
+            continue;
+        }
+        if (strcmp(argv[i], "--max-leaf-size") == 0) {
+            cmd_args.bvh_config.max_leaf_size = atoi(argv[++i]);
+            if (cmd_args.bvh_config.max_leaf_size > BVH_LEAF_MAX_COUNT)
+                printf("Leaves hold at most %d primitives\n", BVH_LEAF_MAX_COUNT);
+            continue;
+        }
+        if (strcmp(argv[i], "--bvh-report") == 0) {
+            cmd_args.bvh_report = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--bvh-autotune") == 0) {
+            cmd_args.bvh_autotune = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--progressive-bvh") == 0) {
+            cmd_args.bvh_config.progressive = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--progressive-bvh-reset") == 0) {
+            cmd_args.bvh_config.progressive = true;
+            cmd_args.progressive_reset = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--bvh-cache") == 0) {
+            cmd_args.bvh_config.cache_dir = argv[++i];
+            continue;
+        }
         if (strcmp(argv[i], "--max-depth") == 0) {
             cmd_args.max_depth = atoi(argv[++i]);
             continue;
         }
+        if (strcmp(argv[i], "--spp-per-launch") == 0) {
+            cmd_args.spp_per_launch = std::max(1, atoi(argv[++i]));
+            continue;
+        }
+        if (strcmp(argv[i], "--target-error") == 0) {
+            cmd_args.target_error = strtof(argv[++i], nullptr);
+            continue;
+        }
+        if (strcmp(argv[i], "--min-samples") == 0) {
+            cmd_args.min_samples = std::max(1, atoi(argv[++i]));
+            continue;
+        }
         if (strcmp(argv[i], "--speed") == 0) {
             cmd_args.camera_speed= strtof(argv[++i], nullptr);
             continue;
@@ -209,6 +400,11 @@ int main(int argc, char** argv) {
         printf("Usage: ./ra <model>\n");
         exit(-1);
     }
+    // The device path of the wavefront kernels has never been run, see atomic_increment
+    if (use_wavefront && gpu) {
+        printf("The wavefront renderer only runs on the CPU for now, use --wavefront with --cpu\n");
+        exit(-1);
+    }
 
     GLFWwindow* window = nullptr;
 
@@ -280,8 +476,14 @@ int main(int argc, char** argv) {
         glfwSetKeyCallback(window, [](GLFWwindow* window, int key, int scancode, int action, int mods) {
             const bool shiftPressed = (mods & GLFW_MOD_SHIFT) == GLFW_MOD_SHIFT;
             if (action == GLFW_PRESS && key == GLFW_KEY_T) {
-                gpu = !gpu;
-                accum = 0;
+                if (use_wavefront) {
+                    printf("The wavefront renderer only runs on the CPU for now\n");
+                } else if (host_copies) {
+                    gpu = !gpu;
+                    accum = 0;
+                } else {
+                    printf("The scene is only on the GPU, run with --keep-host-copies to switch to the CPU\n");
+                }
             } if (action == GLFW_PRESS && key == GLFW_KEY_B) {
                 use_bvh = !use_bvh;
             } if (action == GLFW_PRESS && key == GLFW_KEY_H) {
@@ -317,7 +519,13 @@ int main(int argc, char** argv) {
     runtime_config.use_validation = false;
     runtime_config.dump_spv = true;
     // compiler_config.input_cf.restructure_with_heuristics = true;
+    // Only recursion needs the emulated call stack of dynamic scheduling. The iterative path tracer and the single loop
+    // BVH traversals leave no cycle in the call graph of the kernels.
+#ifdef RA_RECURSIVE_PT
     compiler_config.dynamic_scheduling = true;
+#else
+    compiler_config.dynamic_scheduling = false;
+#endif
 #ifdef RA_USE_RT_PIPELINES
     compiler_config.dynamic_scheduling = false;
     compiler_config.use_rt_pipelines_for_calls = true;
@@ -371,9 +579,36 @@ int main(int argc, char** argv) {
     shady::Buffer* gpu_fb = nullptr;
     shady::Buffer* gpu_film = nullptr;
     uint64_t fb_gpu_addr, film_gpu_addr;
-
-    Model model(model_filename, device);
-    BVHHost bvh(model, device);
+    // Pixels still taking samples in each tile, for adaptive sampling: as of the last frame and counted by this one
+    std::vector<uint32_t> active_tiles, next_active_tiles;
+    shady::Buffer* gpu_active_tiles = nullptr;
+    shady::Buffer* gpu_next_active_tiles = nullptr;
+
+    // Benchmarks measure the final tree
+    bool benchmarks = cmd_args.bench_traversal || cmd_args.bench_layout || cmd_args.bench_material_sort || cmd_args.bench_integrator || cmd_args.bench_refit || cmd_args.bvh_autotune;
+    if (benchmarks)
+        cmd_args.bvh_config.progressive = false;
+
+    Model model(model_filename, device, cmd_args.instancing, cmd_args.point_radius);
+    BVHHost bvh(model, device, cmd_args.bvh_config);
+    bvh.host_bvh.traversal = cmd_args.traversal;
+    bvh.gpu_bvh.traversal = cmd_args.traversal;
+    if (cmd_args.bvh_report)
+        bvh.print_report();
+
+    // Once uploaded, the scene is only needed on the host for rendering there. A progressive build still reads it
+    // until the final tree is swapped in.
+    bool release_scene = gpu && !benchmarks && !cmd_args.keep_host_copies;
+    // Switching to the CPU is refused from here on, it would still be tracing the scene when the swap frees it
+    if (release_scene)
+        host_copies = false;
+    auto release_host_copies = [&] () {
+        assert(gpu);
+        model.release_host_copies();
+        bvh.release_host_copies();
+    };
+    if (release_scene && !bvh.building_in_background())
+        release_host_copies();
 
     // Setup camera
     camera = model.loaded_camera;
@@ -423,7 +658,8 @@ int main(int argc, char** argv) {
 
     auto set_size = [&](int nwidth, int nheight) {
         int fb_size = sizeof(uint32_t) * nwidth * nheight;
-        int film_size = sizeof(float) * nwidth * nheight * 3;
+        int film_size = sizeof(float) * nwidth * nheight * RA_FILM_PLANES;
+        int tiles = ((nwidth + RA_TILE_SIZE - 1) / RA_TILE_SIZE) * ((nheight + RA_TILE_SIZE - 1) / RA_TILE_SIZE);
 
         if (!cpu_fb || (nwidth != WIDTH || nheight != HEIGHT) && nwidth * nheight > 0) {
             WIDTH = nwidth;
@@ -442,6 +678,14 @@ int main(int argc, char** argv) {
                 shd_rn_destroy_buffer(gpu_film);
             gpu_film = shd_rn_allocate_buffer_device(device, film_size);
             film_gpu_addr = shd_rn_get_buffer_device_pointer(gpu_film);
+
+            active_tiles.assign(tiles, 0);
+            next_active_tiles.assign(tiles, 0);
+            for (shady::Buffer** buffer : { &gpu_active_tiles, &gpu_next_active_tiles }) {
+                if (*buffer)
+                    shd_rn_destroy_buffer(*buffer);
+                *buffer = shd_rn_allocate_buffer_device(device, sizeof(uint32_t) * tiles);
+            }
             accum = 0;
 
             fallback_buffer.reset();
@@ -450,7 +694,43 @@ int main(int argc, char** argv) {
 
     set_size(WIDTH, HEIGHT);
 
+    WavefrontHost wavefront(device);
+    wavefront.material_count = model.materials.size();
+
+    if (cmd_args.target_error > 0 && (use_stream || use_wavefront))
+        printf("Adaptive sampling is not supported by the stream and wavefront renderers, PT and PT_NEE sample every pixel\n");
+    // Set once every pixel has reached the target error
+    bool converged = false;
+
     auto render_frame = [&] () {
+        if (bvh.poll_background_build(model)) {
+            if (cmd_args.bvh_report)
+                bvh.print_report();
+            if (cmd_args.progressive_reset)
+                accum = 0;
+            if (release_scene)
+                release_host_copies();
+        }
+
+        AdaptiveSampling adaptive {
+            .target_error = cmd_args.target_error,
+            .min_samples = cmd_args.min_samples,
+        };
+        if ((use_stream || use_wavefront) && (render_mode == PT || render_mode == PT_NEE))
+            adaptive.target_error = 0;
+        bool adaptive_frame = adaptive_sampling_enabled(adaptive, render_mode);
+        if (adaptive_frame) {
+            std::fill(next_active_tiles.begin(), next_active_tiles.end(), 0);
+            if (gpu) {
+                shd_rn_copy_to_buffer(gpu_next_active_tiles, 0, next_active_tiles.data(), sizeof(uint32_t) * next_active_tiles.size());
+                adaptive.active_tiles = reinterpret_cast<const uint32_t*>(shd_rn_get_buffer_device_pointer(gpu_active_tiles));
+                adaptive.next_active_tiles = reinterpret_cast<uint32_t*>(shd_rn_get_buffer_device_pointer(gpu_next_active_tiles));
+            } else {
+                adaptive.active_tiles = active_tiles.data();
+                adaptive.next_active_tiles = next_active_tiles.data();
+            }
+        }
+
         uint64_t render_time;
         if (gpu) {
             std::vector<void*> args;
@@ -463,8 +743,8 @@ int main(int argc, char** argv) {
             if (use_bvh)
                 ntris = 0;
             args.push_back(&ntris);
-            uint64_t ptr_tris = shd_rn_get_buffer_device_pointer(model.triangles_gpu);
-            args.push_back(&ptr_tris);
+            Geometry geometry = model.gpu_geometry();
+            args.push_back(&geometry);
             uint64_t ptr_mats = shd_rn_get_buffer_device_pointer(model.materials_gpu);
             args.push_back(&ptr_mats);
             int nlights = model.emitters.size();
@@ -480,11 +760,21 @@ int main(int argc, char** argv) {
             args.push_back(&accum);
             args.push_back(&render_mode);
             args.push_back(&cmd_args.max_depth);
+            args.push_back(&cmd_args.spp_per_launch);
+            args.push_back(&adaptive);
             //BVH* gpu_bvh = bvh.gpu_bvh;
 
             shady::ExtraKernelOptions launch_options = {
                 .profiled_gpu_time = &render_time,
             };
+            if (use_wavefront && (render_mode == PT || render_mode == PT_NEE)) {
+                wavefront.sort_materials = sort_materials;
+                render_time = wavefront.render(program, camera, WIDTH, HEIGHT,
+                    reinterpret_cast<uint32_t*>(fb_gpu_addr), reinterpret_cast<float*>(film_gpu_addr),
+                    ntris, geometry, reinterpret_cast<Material*>(ptr_mats), nlights, reinterpret_cast<Emitter*>(ptr_emitters),
+                    bvh.gpu_bvh, reinterpret_cast<const TextureDescriptor*>(ptr_tex), reinterpret_cast<const unsigned char*>(ptr_tex_data),
+                    nframe, accum, render_mode, cmd_args.max_depth, cmd_args.spp_per_launch, adaptive);
+            } else
 #ifdef RA_USE_RT_PIPELINES
             if (shd_rn_get_device_backend(device) == shady::VulkanRuntimeBackend)
                 shd_rn_wait_completion(shd_vkr_launch_rays(program, device, "render_a_pixel", WIDTH, HEIGHT, 1, args.size(), args.data(), &launch_options));
@@ -493,20 +783,55 @@ int main(int argc, char** argv) {
             shd_rn_wait_completion(shd_rn_launch_kernel(program, device, "render_a_pixel", (WIDTH + 15) / 16, (HEIGHT + 15) / 16, 1, args.size(), args.data(), &launch_options));
         } else {
             auto then = time();
-            #pragma omp parallel for
-            for (int x = 0; x < WIDTH; x++) {
-                #pragma omp simd
-                for (int y = 0; y < HEIGHT; y++) {
-                    gl_GlobalInvocationID.x = x;
-                    gl_GlobalInvocationID.y = y;
-                    int ntris = model.triangles.size();
-                    if (use_bvh)
-                        ntris = 0;
-                    int nlights = model.emitters.size();
-                    render_a_pixel(camera, WIDTH, HEIGHT, cpu_fb, cpu_film,
-                        ntris, model.triangles.data(), model.materials.data(), nlights, model.emitters.data(),
-                        bvh.host_bvh, model.textures.data(), model.texture_data.data(),
-                        nframe, accum, render_mode, cmd_args.max_depth);
+            if (use_wavefront && (render_mode == PT || render_mode == PT_NEE)) {
+                int nlights = model.emitters.size();
+                wavefront.sort_materials = sort_materials;
+                wavefront.render(nullptr, camera, WIDTH, HEIGHT, cpu_fb, cpu_film,
+                    0, model.host_geometry(), model.materials.data(), nlights, model.emitters.data(),
+                    bvh.host_bvh, model.textures.data(), model.texture_data.data(),
+                    nframe, accum, render_mode, cmd_args.max_depth, cmd_args.spp_per_launch, adaptive);
+            } else if (use_stream && (render_mode == PT || render_mode == PT_NEE)) {
+                int nlights = model.emitters.size();
+                render_a_stream(camera, WIDTH, HEIGHT, cpu_fb, cpu_film,
+                    0, model.host_geometry(), model.materials.data(), nlights, model.emitters.data(),
+                    bvh.host_bvh, model.textures.data(), model.texture_data.data(),
+                    nframe, accum, render_mode, cmd_args.max_depth, cmd_args.spp_per_launch, adaptive, sort_materials, &rays_traced);
+            } else if (use_packets) {
+                // Neighbouring pixels are traced together, see packet.h
+                #pragma omp parallel for
+                for (int x = 0; x < WIDTH; x += RA_PACKET_WIDTH) {
+                    for (int y = 0; y < HEIGHT; y += RA_PACKET_HEIGHT) {
+                        // Packets don't straddle tiles, so a converged tile has no pixel left in them
+                        if (adaptive_frame && accum > 0 && active_tiles[tile_index(x, y, WIDTH)] == 0)
+                            continue;
+                        gl_GlobalInvocationID.x = x;
+                        gl_GlobalInvocationID.y = y;
+                        int ntris = model.triangles.size();
+                        if (use_bvh)
+                            ntris = 0;
+                        int nlights = model.emitters.size();
+                        render_a_packet(camera, WIDTH, HEIGHT, cpu_fb, cpu_film,
+                            ntris, model.host_geometry(), model.materials.data(), nlights, model.emitters.data(),
+                            bvh.host_bvh, model.textures.data(), model.texture_data.data(),
+                            nframe, accum, render_mode, cmd_args.max_depth, cmd_args.spp_per_launch, adaptive);
+                    }
+                }
+            } else {
+                #pragma omp parallel for
+                for (int x = 0; x < WIDTH; x++) {
+                    #pragma omp simd
+                    for (int y = 0; y < HEIGHT; y++) {
+                        gl_GlobalInvocationID.x = x;
+                        gl_GlobalInvocationID.y = y;
+                        int ntris = model.triangles.size();
+                        if (use_bvh)
+                            ntris = 0;
+                        int nlights = model.emitters.size();
+                        render_a_pixel(camera, WIDTH, HEIGHT, cpu_fb, cpu_film,
+                            ntris, model.host_geometry(), model.materials.data(), nlights, model.emitters.data(),
+                            bvh.host_bvh, model.textures.data(), model.texture_data.data(),
+                            nframe, accum, render_mode, cmd_args.max_depth, cmd_args.spp_per_launch, adaptive);
+                    }
                 }
             }
             auto now = time();
@@ -518,8 +843,18 @@ int main(int argc, char** argv) {
         delta = (float) ((now - prev_frame) / 1000000) / 1000.0f;
         prev_frame = now;
 
+        if (adaptive_frame) {
+            if (gpu)
+                shd_rn_copy_from_buffer(gpu_next_active_tiles, 0, next_active_tiles.data(), sizeof(uint32_t) * next_active_tiles.size());
+            std::swap(active_tiles, next_active_tiles);
+            std::swap(gpu_active_tiles, gpu_next_active_tiles);
+            converged = std::all_of(active_tiles.begin(), active_tiles.end(), [](uint32_t active) { return active == 0; });
+        } else {
+            converged = false;
+        }
+
         nframe++;
-        accum++;
+        accum += mode_accumulates(render_mode) ? cmd_args.spp_per_launch : 1;
     };
 
     auto present_frame = [&](imr::Swapchain::Frame& frame) {
@@ -562,12 +897,232 @@ int main(int argc, char** argv) {
         printf("Screenshot saved to 'screenshot.png'\n");
     };
 
+    if (cmd_args.bench_traversal) {
+        // Renders the same frames on the CPU with each traversal variant and checks that they produce the same image
+        gpu = false;
+        int frames = max_frames > 0 ? max_frames : 1;
+        std::vector<uint32_t> reference;
+        for (BVHTraversal traversal : { BVH_TRAVERSAL_STACK, BVH_TRAVERSAL_STACKLESS }) {
+            bvh.host_bvh.traversal = traversal;
+            nframe = 0;
+            accum = 0;
+            total_time = 0;
+            for (int i = 0; i < frames; i++)
+                render_frame();
+
+            double ms = total_time / (1000.0 * 1000.0);
+            printf("%-10s traversal: %d frames in %.1fms (%.2f Msamples/s)\n", traversal == BVH_TRAVERSAL_STACK ? "stack" : "stackless",
+                frames, ms, (double) WIDTH * HEIGHT * accum / (ms * 1000.0));
+
+            if (reference.empty()) {
+                reference.assign(cpu_fb, cpu_fb + WIDTH * HEIGHT);
+            } else {
+                size_t mismatches = 0;
+                for (size_t i = 0; i < reference.size(); i++)
+                    mismatches += reference[i] != cpu_fb[i];
+                printf("%zu pixels differ from the stack traversal\n", mismatches);
+            }
+        }
+        bvh.host_bvh.traversal = cmd_args.traversal;
+        runs = 0;
+    }
+
+    if (cmd_args.bench_material_sort) {
+        // Renders the same frames with and without sorting the hits by material, with the stream renderer unless the
+        // wavefront one was picked
+        if (render_mode != PT && render_mode != PT_NEE) {
+            printf("Only PT and PT_NEE sort hits by material\n");
+        } else {
+            if (!use_wavefront) {
+                use_stream = true;
+                gpu = false;
+            }
+            int frames = max_frames > 0 ? max_frames : 1;
+            std::vector<uint32_t> reference;
+            for (bool sort : { false, true }) {
+                sort_materials = sort;
+                nframe = 0;
+                accum = 0;
+                total_time = 0;
+                rays_traced = 0;
+                wavefront.rays_traced = 0;
+                for (int i = 0; i < frames; i++)
+                    render_frame();
+
+                double ms = total_time / (1000.0 * 1000.0);
+                printf("%-8s shading: %d frames in %.1fms (%.2f Mrays/s)\n", sort ? "sorted" : "unsorted", frames, ms,
+                    (rays_traced + wavefront.rays_traced) / (ms * 1000.0));
+
+                if (gpu)
+                    shd_rn_copy_from_buffer(gpu_fb, 0, cpu_fb, sizeof(uint32_t) * WIDTH * HEIGHT);
+                if (reference.empty()) {
+                    reference.assign(cpu_fb, cpu_fb + WIDTH * HEIGHT);
+                } else {
+                    size_t mismatches = 0;
+                    for (size_t i = 0; i < reference.size(); i++)
+                        mismatches += reference[i] != cpu_fb[i];
+                    printf("%zu pixels differ from the unsorted shading\n", mismatches);
+                }
+            }
+            runs = 0;
+        }
+    }
+
+    if (cmd_args.bench_integrator) {
+        // Times the path tracer this build was made with, iterative or recursive (RA_RECURSIVE_PT), on the CPU or on the
+        // device. Comparing two builds on the same scene and frames gives the speedup, and the checksums tell whether
+        // they rendered the same image.
+        if (render_mode != PT && render_mode != PT_NEE) {
+            printf("Only PT and PT_NEE run the path tracer\n");
+        } else {
+            use_stream = false;
+            use_wavefront = false;
+            int frames = max_frames > 0 ? max_frames : 1;
+            nframe = 0;
+            accum = 0;
+            total_time = 0;
+            for (int i = 0; i < frames; i++)
+                render_frame();
+
+            if (gpu)
+                shd_rn_copy_from_buffer(gpu_fb, 0, cpu_fb, sizeof(uint32_t) * WIDTH * HEIGHT);
+            uint64_t checksum = 0xcbf29ce484222325ull;
+            for (size_t i = 0; i < (size_t) WIDTH * HEIGHT; i++)
+                checksum = (checksum ^ cpu_fb[i]) * 0x100000001b3ull;
+            double ms = total_time / (1000.0 * 1000.0);
+#ifdef RA_RECURSIVE_PT
+            const char* integrator = "recursive";
+#else
+            const char* integrator = "iterative";
+#endif
+            printf("%s path tracer on the %s: %d frames in %.1fms (%.2f Msamples/s), image checksum %016llx\n", integrator,
+                gpu ? "device" : "CPU", frames, ms, (double) WIDTH * HEIGHT * accum / (ms * 1000.0), (unsigned long long) checksum);
+        }
+        runs = 0;
+    }
+
+    if (cmd_args.bench_layout) {
+        // Renders the same frames on the CPU with each node layout, with the cache misses if the kernel lets us count them
+        gpu = false;
+        int frames = max_frames > 0 ? max_frames : 1;
+        int counter = open_cache_miss_counter();
+        if (counter < 0)
+            printf("Cache miss counter not available\n");
+        for (BVHNodeLayout layout : { BVH_LAYOUT_DEPTH_FIRST, BVH_LAYOUT_TREELETS }) {
+            bvh.reorder_nodes(layout);
+            bvh.release_upload();
+            bvh.upload();
+            nframe = 0;
+            accum = 0;
+            total_time = 0;
+#ifdef __linux__
+            if (counter >= 0) {
+                ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+                ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+            }
+#endif
+            for (int i = 0; i < frames; i++)
+                render_frame();
+            uint64_t misses = 0;
+#ifdef __linux__
+            if (counter >= 0) {
+                ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(counter, &misses, sizeof(misses)) != sizeof(misses))
+                    misses = 0;
+            }
+#endif
+
+            double ms = total_time / (1000.0 * 1000.0);
+            double samples = (double) WIDTH * HEIGHT * accum;
+            printf("%-8s layout: %d frames in %.1fms (%.2f Msamples/s)", layout == BVH_LAYOUT_DEPTH_FIRST ? "dfs" : "treelets",
+                frames, ms, samples / (ms * 1000.0));
+            if (counter >= 0)
+                printf(", %.2f cache misses per sample", misses / samples);
+            printf("\n");
+        }
+#ifdef __linux__
+        if (counter >= 0)
+            close(counter);
+#endif
+        bvh.reorder_nodes(cmd_args.bvh_config.node_layout);
+        bvh.release_upload();
+        bvh.upload();
+        runs = 0;
+    }
+
+    if (cmd_args.bvh_autotune) {
+        // Renders a few frames with each leaf size on the selected device and keeps the fastest tree
+        int frames = max_frames > 0 ? max_frames : 4;
+        BVHBuildConfig best = cmd_args.bvh_config;
+        double best_ms = INFINITY;
+        for (int max_leaf_size : { 1, 2, 4, 8, 12, 15 }) {
+            for (int min_leaf_size : { 1, 2, 4 }) {
+                if (min_leaf_size > max_leaf_size)
+                    continue;
+                BVHBuildConfig build_config = cmd_args.bvh_config;
+                build_config.min_leaf_size = min_leaf_size;
+                build_config.max_leaf_size = max_leaf_size;
+                bvh.rebuild(model, build_config);
+                nframe = 0;
+                accum = 0;
+                total_time = 0;
+                for (int i = 0; i < frames; i++)
+                    render_frame();
+
+                double ms = total_time / (1000.0 * 1000.0);
+                printf("Leaf size %2d to %2d: SAH cost %.2f, %d frames in %.1fms (%.2f Msamples/s)\n", min_leaf_size, max_leaf_size,
+                    bvh.built_sah, frames, ms, (double) WIDTH * HEIGHT * accum / (ms * 1000.0));
+                if (ms < best_ms) {
+                    best_ms = ms;
+                    best = build_config;
+                }
+            }
+        }
+        printf("Fastest leaf size: --min-leaf-size %d --max-leaf-size %d\n", best.min_leaf_size, best.max_leaf_size);
+        cmd_args.bvh_config = best;
+        bvh.rebuild(model, best);
+        if (cmd_args.bvh_report)
+            bvh.print_report();
+    }
+
+    if (cmd_args.bench_refit) {
+        // Animates the model with a wave running along the x axis and compares refitting the BVH to building it again
+        float extent = fmaxf(1e-4f, bvh.scene_max.x - bvh.scene_min.x);
+        float amplitude = 0.01f * extent;
+        float frequency = 6.2831853f / extent;
+        std::vector<vec3> rest = model.positions;
+        // A rebuild renumbers the vertices, the rest positions stay in the order they were taken in
+        model.vertex_ids.resize(rest.size());
+        std::iota(model.vertex_ids.begin(), model.vertex_ids.end(), 0);
+        auto wave = [&](vec3 p, int frame) { return p + vec3(0.0f, amplitude * sinf(frequency * p.x + frame), 0.0f); };
+
+        int frames = max_frames > 0 ? max_frames : 10;
+        int rebuilds = 0;
+        uint64_t refit_time = 0;
+        for (int frame = 1; frame <= frames; frame++) {
+            for (size_t i = 0; i < rest.size(); i++)
+                model.positions[i] = wave(rest[model.vertex_ids[i]], frame);
+            uint64_t start = time();
+            rebuilds += bvh.refit(model);
+            refit_time += time() - start;
+        }
+        printf("Refit: %d frames in %.2fms (%d full rebuilds), SAH cost is %.2f\n", frames, refit_time / (1000.0 * 1000.0), rebuilds, bvh.sah_cost());
+
+        BVHBuildConfig build_config = cmd_args.bvh_config;
+        build_config.cache_dir = nullptr;
+        uint64_t start = time();
+        BVHHost rebuilt(model, device, build_config);
+        printf("Build: %.2fms\n", (time() - start) / (1000.0 * 1000.0));
+        runs = 0;
+    }
+
     for (int run = 0; run < runs; run++) {
         nframe = 0;
         total_time = 0;
         accum = 0;
+        converged = false;
 
-        while ((max_frames == 0 || nframe < max_frames) && (!window || !glfwWindowShouldClose(window))) {
+        while ((max_frames == 0 || nframe < max_frames) && !(headless && converged) && (!window || !glfwWindowShouldClose(window))) {
             using Frame = imr::Swapchain::Frame;
             if (headless)
                 render_frame();
@@ -596,6 +1151,20 @@ int main(int argc, char** argv) {
         }
 
         printf("Rendered %d frames in %zums\n", nframe, total_time / (1000 * 1000));
+        if (converged)
+            printf("Every pixel reached the target error of %g, after at most %u samples\n", cmd_args.target_error, accum);
+        if (rays_traced + wavefront.rays_traced > 0)
+            printf("Traced %.2f Mrays/s\n", (rays_traced + wavefront.rays_traced) / (total_time / 1000.0));
+
+        if (render_mode == PRIMARY_HEATMAP && accum > 0) {
+            // The first film component holds the sum of the traversal steps of each pixel, see shade_primary_hit
+            if (gpu)
+                shd_rn_copy_from_buffer(gpu_film, 0, cpu_film, sizeof(float) * WIDTH * HEIGHT);
+            double steps = 0;
+            for (int i = 0; i < WIDTH * HEIGHT; i++)
+                steps += cpu_film[i];
+            printf("Average traversal steps per primary ray: %.2f\n", steps / ((double) WIDTH * HEIGHT * accum));
+        }
 
         if (headless)
             save_screenshot();
@@ -4,6 +4,7 @@
 #include <assimp/scene.h>           // Output data structure
 #include <assimp/postprocess.h>     // Post processing flags
 
+#include <algorithm>
 #include <cassert>
 #include <vector>
 #include <unordered_set>
@@ -42,7 +43,68 @@ void remap_texture_argb_rgba(unsigned char* buffer, size_t width, size_t height)
     }
 }
 
-Model::Model(const char* path, Device* device) {
+static uint32_t encode_snorm16(float f) {
+    return (uint32_t) lrintf(fminf(fmaxf(f, -1.0f), 1.0f) * 32767.0f) & 0xFFFF;
+}
+
+// Rounds to the nearest half float, clamped to the largest finite one
+static uint32_t encode_half(float f) {
+    uint32_t sign = std::signbit(f) ? 0x8000 : 0;
+    float a = fminf(fabsf(f), 65504.0f);
+    if (a < 6.1035156e-5f) // Subnormal, in steps of 2^-24
+        return sign | (uint32_t) lrintf(a / 5.9604645e-8f);
+    int exponent;
+    float mantissa = frexpf(a, &exponent) * 2.0f - 1.0f;
+    uint32_t bits = ((uint32_t) (exponent + 14) << 10) + (uint32_t) lrintf(mantissa * 1024.0f);
+    return sign | std::min<uint32_t>(bits, 0x7BFF);
+}
+
+VertexAttributes encode_vertex_attributes(vec3 normal, vec2 texcoords) {
+    vec2 oct = octahedral_encode(normal);
+    return VertexAttributes {
+        .normal = encode_snorm16(oct.x) | (encode_snorm16(oct.y) << 16),
+        .texcoords = encode_half(texcoords.x) | (encode_half(texcoords.y) << 16),
+    };
+}
+
+static Instance make_instance(const aiMatrix4x4& to_world, int mesh) {
+    aiMatrix4x4 to_object = to_world;
+    to_object.Inverse();
+    return Instance {
+        .to_world = {
+            { to_world.a1, to_world.b1, to_world.c1 },
+            { to_world.a2, to_world.b2, to_world.c2 },
+            { to_world.a3, to_world.b3, to_world.c3 },
+            { to_world.a4, to_world.b4, to_world.c4 },
+        },
+        .to_object = {
+            { to_object.a1, to_object.b1, to_object.c1 },
+            { to_object.a2, to_object.b2, to_object.c2 },
+            { to_object.a3, to_object.b3, to_object.c3 },
+            { to_object.a4, to_object.b4, to_object.c4 },
+        },
+        .mesh = mesh,
+        .root = 0,
+    };
+}
+
+// Every reference to a mesh in the node graph becomes an instance
+static void collect_instances(const aiNode* node, const aiMatrix4x4& parent_to_world, std::vector<Instance>& instances) {
+    aiMatrix4x4 to_world = parent_to_world * node->mTransformation;
+    for (int i = 0; i < node->mNumMeshes; i++)
+        instances.push_back(make_instance(to_world, node->mMeshes[i]));
+    for (int i = 0; i < node->mNumChildren; i++)
+        collect_instances(node->mChildren[i], to_world, instances);
+}
+
+static aiMatrix4x4 node_to_world(const aiNode* node) {
+    aiMatrix4x4 to_world;
+    for (; node; node = node->mParent)
+        to_world = node->mTransformation * to_world;
+    return to_world;
+}
+
+Model::Model(const char* path, Device* device, bool instancing, float point_radius) : device(device) {
     Assimp::Importer importer;
 
     // And have it read the given file with some example postprocessing
@@ -50,7 +112,8 @@ Model::Model(const char* path, Device* device) {
     // probably to request more postprocessing than we do in this example.
     const aiScene* scene = importer.ReadFile( path,
                                                 aiProcess_Triangulate
-                                              | aiProcess_PreTransformVertices
+                                              | aiProcess_JoinIdenticalVertices
+                                              | (instancing ? 0 : aiProcess_PreTransformVertices)
                                               | aiProcess_SortByPType
                                               | aiProcess_GenSmoothNormals
                                               | aiProcess_RemoveRedundantMaterials
@@ -243,67 +306,119 @@ Model::Model(const char* path, Device* device) {
     // A pretty implementation would merge some materials if they are not unique
     for (const auto& mat: materials)
         printf("MAT c=(%f,%f,%f) r=%f, m=%f, n=%f, t=%f\n", mat.base_color[0], mat.base_color[1], mat.base_color[2], mat.roughness, mat.metallic, mat.ior, mat.transmission);
-    offload(device, materials, materials_gpu);
 
     // --------------- Triangles
-    std::vector<Triangle> tris;
+    // The vertices of all meshes go into one array, the triangles index it
+    std::vector<const aiMesh*> point_clouds;
     for (int i = 0; i < scene->mNumMeshes; i++) {
         auto mesh = scene->mMeshes[i];
         int mat_id = scene->HasMaterials() ? mesh->mMaterialIndex : 0;
+        // aiProcess_SortByPType puts point clouds in meshes of their own, their points become spheres
+        if (mesh->mPrimitiveTypes == aiPrimitiveType_POINT) {
+            if (instancing) {
+                printf("Skipping point cloud '%s', spheres can't be instanced\n", mesh->mName.C_Str());
+                // Instances refer to meshes by index, the ones of this mesh are dropped once collected
+                meshes.push_back(Mesh { .first_triangle = (int) triangles.size(), .triangle_count = 0 });
+            } else {
+                point_clouds.push_back(mesh);
+            }
+            continue;
+        }
+        int first_vertex = (int) positions.size();
+        for (int j = 0; j < mesh->mNumVertices; j++) {
+            auto v = mesh->mVertices[j];
+            aiVector3D n = mesh->HasNormals() ? mesh->mNormals[j] : aiVector3D(0,0,1);
+            // Texture Coords (we only support 2D)
+            aiVector3D t = mesh->HasTextureCoords(0) ? mesh->mTextureCoords[0][j] : aiVector3D(0);
+            positions.push_back(vec3 { v.x, v.y, v.z });
+            attributes.push_back(encode_vertex_attributes(vec3 { n.x, n.y, n.z }, vec2 { t.x, t.y }));
+        }
+
+        if (instancing)
+            meshes.push_back(Mesh { .first_triangle = (int) triangles.size(), .triangle_count = (int) mesh->mNumFaces });
         for (int j = 0; j < mesh->mNumFaces; j++) {
             auto& face = mesh->mFaces[j];
             assert(face.mNumIndices == 3);
-            auto v0 = mesh->mVertices[face.mIndices[0]];
-            auto v1 = mesh->mVertices[face.mIndices[1]];
-            auto v2 = mesh->mVertices[face.mIndices[2]];
-
-            aiVector3D n0 = aiVector3D(0,0,1);
-            aiVector3D n1 = aiVector3D(0,0,1);
-            aiVector3D n2 = aiVector3D(0,0,1);
-            if (mesh->HasNormals()) {
-                n0 = mesh->mNormals[face.mIndices[0]];
-                n1 = mesh->mNormals[face.mIndices[1]];
-                n2 = mesh->mNormals[face.mIndices[2]];
-            }
+            triangles.push_back(IndexedTriangle {
+                .vertices = {
+                    first_vertex + (int) face.mIndices[0],
+                    first_vertex + (int) face.mIndices[1],
+                    first_vertex + (int) face.mIndices[2],
+                },
+                .mat_id = mat_id,
+            });
+        }
+    }
+    Geometry geometry = host_geometry();
+
+    if (!instancing) {
+        for (int i = 0; i < triangles.size(); i++) {
+            int mat_id = triangles[i].mat_id;
+            if (!emissive_materials.contains(mat_id))
+                continue;
+            float area = geometry.get_triangle(i).get_area();
+            if (area > 0)
+                emitters.push_back(Emitter{ .emission = vec3{materials[mat_id].emission[0], materials[mat_id].emission[1], materials[mat_id].emission[2]}, .prim_id = i});
+        }
+    }
 
-            aiVector3D t0 = aiVector3D(0);
-            aiVector3D t1 = aiVector3D(0);
-            aiVector3D t2 = aiVector3D(0);
-            if (mesh->HasTextureCoords(0)) {
-                t0 = mesh->mTextureCoords[0][face.mIndices[0]];
-                t1 = mesh->mTextureCoords[0][face.mIndices[1]];
-                t2 = mesh->mTextureCoords[0][face.mIndices[2]];
+    if (instancing) {
+        // Emissive meshes get one emitter per triangle and instance, in world space
+        collect_instances(scene->mRootNode, aiMatrix4x4(), instances);
+        std::erase_if(instances, [&] (const Instance& instance) { return meshes[instance.mesh].triangle_count == 0; });
+        for (int i = 0; i < instances.size(); i++) {
+            const Mesh& mesh = meshes[instances[i].mesh];
+            for (int j = mesh.first_triangle; j < mesh.first_triangle + mesh.triangle_count; j++) {
+                int mat_id = triangles[j].mat_id;
+                if (!emissive_materials.contains(mat_id))
+                    continue;
+                float area = instances[i].to_world_triangle(geometry.get_triangle(j)).get_area();
+                if (area > 0)
+                    emitters.push_back(Emitter{ .emission = vec3{materials[mat_id].emission[0], materials[mat_id].emission[1], materials[mat_id].emission[2]}, .prim_id = j, .inst_id = i });
             }
+        }
+        printf("Loaded %zu instances of %zu meshes\n", instances.size(), meshes.size());
+    }
 
-            Triangle tri {
-                .prim_id = (int32_t)tris.size(), // TODO: Better 64bit
-                .mat_id = mat_id,
-                // Vertices
-                .v0 = { v0.x, v0.y, v0.z },
-                .v1 = { v1.x, v1.y, v1.z },
-                .v2 = { v2.x, v2.y, v2.z },
-                // Normals
-                .n0 = { n0.x, n0.y, n0.z },
-                .n1 = { n1.x, n1.y, n1.z },
-                .n2 = { n2.x, n2.y, n2.z },
-                // Texture Coords (we only support 2D)
-                .t0 = { t0.x, t0.y },
-                .t1 = { t1.x, t1.y },
-                .t2 = { t2.x, t2.y },
-            };
-            tris.push_back(tri);
-
-            if (emissive_materials.contains(mat_id)) {
-                float area = tri.get_area();
-                if (area > 0)
-                    emitters.push_back(Emitter{ .emission = vec3{materials[mat_id].emission[0], materials[mat_id].emission[1], materials[mat_id].emission[2]}, .prim_id = tri.prim_id});
+    // --------------- Spheres
+    if (!point_clouds.empty()) {
+        if (point_radius <= 0) {
+            // Half the spacing the points would have if they were spread evenly over their bounds
+            BBox bounds { vec3(INFINITY), vec3(-INFINITY) };
+            size_t count = 0;
+            for (const aiMesh* mesh : point_clouds) {
+                for (int j = 0; j < mesh->mNumVertices; j++) {
+                    for (int axis = 0; axis < 3; axis++) {
+                        bounds.min.arr[axis] = fminf(bounds.min.arr[axis], mesh->mVertices[j][axis]);
+                        bounds.max.arr[axis] = fmaxf(bounds.max.arr[axis], mesh->mVertices[j][axis]);
+                    }
+                }
+                count += mesh->mNumVertices;
+            }
+            vec3 extent = bounds.max - bounds.min;
+            point_radius = fmaxf(fmaxf(extent.x, extent.y), extent.z) / cbrtf((float) count) * 0.5f;
+            if (point_radius <= 0)
+                point_radius = 1;
+        }
+        for (const aiMesh* mesh : point_clouds) {
+            int mat_id = scene->HasMaterials() ? mesh->mMaterialIndex : 0;
+            for (int j = 0; j < mesh->mNumVertices; j++) {
+                auto v = mesh->mVertices[j];
+                spheres.push_back(Sphere { .center = vec3 { v.x, v.y, v.z }, .radius = point_radius });
+                sphere_materials.push_back(mat_id);
             }
         }
+        printf("Loaded %zu spheres of radius %f (%zu kb)\n", spheres.size(), point_radius, spheres.size() * (sizeof(Sphere) + sizeof(int)) / 1024);
+        offload(device, spheres, spheres_gpu);
+        offload(device, sphere_materials, sphere_materials_gpu);
     }
 
-    this->triangles = std::move(tris);
-    printf("Loaded %zu triangles (%zu Mb)\n", this->triangles.size(), triangles.size() * sizeof(Triangle) / (1024*1024));
+    size_t geometry_size = triangles.size() * sizeof(IndexedTriangle) + positions.size() * (sizeof(vec3) + sizeof(VertexAttributes));
+    printf("Loaded %zu triangles and %zu vertices (%zu Mb)\n", triangles.size(), positions.size(), geometry_size / (1024*1024));
+    printf("Quantized vertex attributes take %zu kb instead of %zu kb\n", attributes.size() * sizeof(VertexAttributes) / 1024, attributes.size() * (sizeof(vec3) + sizeof(vec2)) / 1024);
     offload(device, triangles, triangles_gpu);
+    offload(device, positions, positions_gpu);
+    offload(device, attributes, attributes_gpu);
 
     // --------------- Lights
     if (emitters.empty() || (emitters.size() == 1 && color_average(emitters.at(0).emission) == 0)) {
@@ -321,6 +436,9 @@ Model::Model(const char* path, Device* device) {
     } else {
         printf("Too many lights to dump. Skipping it.\n");
     }
+    build_emitter_table();
+    // Uploaded after the emitter table, which fills in Material::emitter_pdf
+    offload(device, materials, materials_gpu);
     offload(device, emitters, emitters_gpu);
 
     // -------------- Upload textures
@@ -341,7 +459,17 @@ Model::Model(const char* path, Device* device) {
     if (scene->HasCameras()) {
         printf("Loading embedded camera\n");
 
-        const auto camera = scene->mCameras[0];
+        aiCamera* camera = scene->mCameras[0];
+        aiCamera placed_camera;
+        if (instancing) {
+            // Without pre-transforming, the camera is still relative to its node
+            aiMatrix4x4 to_world = node_to_world(scene->mRootNode->FindNode(camera->mName));
+            placed_camera = *camera;
+            placed_camera.mPosition = to_world * camera->mPosition;
+            placed_camera.mLookAt = aiMatrix3x3(to_world) * camera->mLookAt;
+            placed_camera.mUp = aiMatrix3x3(to_world) * camera->mUp;
+            camera = &placed_camera;
+        }
         aiMatrix4x4 cameraMatrix;
         camera->GetCameraMatrix(cameraMatrix);
 
@@ -359,10 +487,185 @@ Model::Model(const char* path, Device* device) {
     camera_update_orientation(&loaded_camera, loaded_camera.direction, loaded_camera.up);
 }
 
+Geometry Model::host_geometry() const {
+    return Geometry {
+        .triangles = triangles.data(),
+        .positions = positions.data(),
+        .attributes = attributes.data(),
+        .spheres = spheres.data(),
+        .sphere_materials = sphere_materials.data(),
+    };
+}
+
+Geometry Model::gpu_geometry() const {
+    return Geometry {
+        .triangles = reinterpret_cast<IndexedTriangle*>(shd_rn_get_buffer_device_pointer(triangles_gpu)),
+        .positions = reinterpret_cast<vec3*>(shd_rn_get_buffer_device_pointer(positions_gpu)),
+        .attributes = reinterpret_cast<VertexAttributes*>(shd_rn_get_buffer_device_pointer(attributes_gpu)),
+        .spheres = spheres_gpu ? reinterpret_cast<Sphere*>(shd_rn_get_buffer_device_pointer(spheres_gpu)) : nullptr,
+        .sphere_materials = sphere_materials_gpu ? reinterpret_cast<int*>(shd_rn_get_buffer_device_pointer(sphere_materials_gpu)) : nullptr,
+    };
+}
+
+void Model::build_emitter_table() {
+    // Nothing of the previous table is kept. Without emitters to pick, it is left with zero probabilities everywhere,
+    // so that next event estimation never samples and emitters hit by the BSDF get their full weight.
+    for (int i = 0; i < emitters.size(); i++) {
+        emitters[i].pdf = 0;
+        emitters[i].alias_probability = 1;
+        emitters[i].alias = i;
+    }
+    for (Material& material : materials)
+        material.emitter_pdf = 0;
+
+    // Emitter 0 is the environment, next event estimation picks among the others
+    int count = emitters.size() - 1;
+    if (count <= 0)
+        return;
+
+    Geometry geometry = host_geometry();
+    std::vector<double> weights(count);
+    double total = 0;
+    for (int i = 0; i < count; i++) {
+        Emitter& emitter = emitters[i + 1];
+        Triangle tri = geometry.get_triangle(emitter.prim_id);
+        if (emitter.inst_id >= 0)
+            tri = instances[emitter.inst_id].to_world_triangle(tri);
+        emitter.normal = tri.get_face_normal();
+        weights[i] = color_luminance(emitter.emission) * tri.get_area();
+        total += weights[i];
+    }
+    if (total <= 0)
+        return;
+
+    // A point on an emitter is picked with probability weight / total, spread over its area
+    for (int i = 0; i < count; i++)
+        emitters[i + 1].pdf = color_luminance(emitters[i + 1].emission) / total;
+    for (Material& material : materials)
+        material.emitter_pdf = color_luminance(material.emission) / total;
+
+    // Vose's method: slots under the average weight are topped up by one slot over it
+    std::vector<double> scaled(count);
+    std::vector<int> small, large;
+    for (int i = 0; i < count; i++) {
+        scaled[i] = weights[i] * count / total;
+        (scaled[i] < 1 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        int s = small.back();
+        small.pop_back();
+        int l = large.back();
+        emitters[s + 1].alias_probability = scaled[s];
+        emitters[s + 1].alias = l + 1;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // What is left is full, up to rounding
+    for (int i : small)
+        emitters[i + 1].alias_probability = 1;
+    for (int i : large)
+        emitters[i + 1].alias_probability = 1;
+}
+
+void Model::reorder_triangles(const std::vector<int>& order) {
+    assert(order.size() == triangles.size());
+    std::vector<IndexedTriangle> new_triangles(triangles.size());
+    std::vector<int> new_ids(triangles.size());
+    for (int i = 0; i < order.size(); i++) {
+        new_triangles[i] = triangles[order[i]];
+        new_ids[order[i]] = i;
+    }
+
+    std::vector<int> new_vertices(positions.size(), -1);
+    int vertex_count = 0;
+    for (IndexedTriangle& tri : new_triangles) {
+        for (int& vertex : tri.vertices) {
+            if (new_vertices[vertex] < 0)
+                new_vertices[vertex] = vertex_count++;
+            vertex = new_vertices[vertex];
+        }
+    }
+    // Vertices no triangle uses go last
+    for (int& vertex : new_vertices) {
+        if (vertex < 0)
+            vertex = vertex_count++;
+    }
+    std::vector<vec3> new_positions(positions.size());
+    std::vector<VertexAttributes> new_attributes(attributes.size());
+    for (int i = 0; i < positions.size(); i++) {
+        new_positions[new_vertices[i]] = positions[i];
+        new_attributes[new_vertices[i]] = attributes[i];
+    }
+    if (!vertex_ids.empty()) {
+        std::vector<int> new_vertex_ids(vertex_ids.size());
+        for (int i = 0; i < vertex_ids.size(); i++)
+            new_vertex_ids[new_vertices[i]] = vertex_ids[i];
+        vertex_ids = std::move(new_vertex_ids);
+    }
+
+    for (Emitter& emitter : emitters) {
+        if (emitter.prim_id >= 0)
+            emitter.prim_id = new_ids[emitter.prim_id];
+    }
+
+    triangles = std::move(new_triangles);
+    positions = std::move(new_positions);
+    attributes = std::move(new_attributes);
+
+    shd_rn_destroy_buffer(triangles_gpu);
+    shd_rn_destroy_buffer(positions_gpu);
+    shd_rn_destroy_buffer(attributes_gpu);
+    shd_rn_destroy_buffer(emitters_gpu);
+    triangles_gpu = positions_gpu = attributes_gpu = emitters_gpu = nullptr;
+    offload(device, triangles, triangles_gpu);
+    offload(device, positions, positions_gpu);
+    offload(device, attributes, attributes_gpu);
+    offload(device, emitters, emitters_gpu);
+}
+
+void Model::reorder_spheres(const std::vector<int>& order) {
+    assert(order.size() == spheres.size());
+    if (spheres.empty())
+        return;
+    std::vector<Sphere> new_spheres(spheres.size());
+    std::vector<int> new_materials(spheres.size());
+    for (int i = 0; i < order.size(); i++) {
+        new_spheres[i] = spheres[order[i]];
+        new_materials[i] = sphere_materials[order[i]];
+    }
+    spheres = std::move(new_spheres);
+    sphere_materials = std::move(new_materials);
+
+    shd_rn_destroy_buffer(spheres_gpu);
+    shd_rn_destroy_buffer(sphere_materials_gpu);
+    spheres_gpu = sphere_materials_gpu = nullptr;
+    offload(device, spheres, spheres_gpu);
+    offload(device, sphere_materials, sphere_materials_gpu);
+}
+
+void Model::release_host_copies() {
+    release(triangles);
+    release(positions);
+    release(vertex_ids);
+    release(attributes);
+    release(spheres);
+    release(sphere_materials);
+    release(texture_data);
+}
+
 Model::~Model() {
     shd_rn_destroy_buffer(triangles_gpu);
+    shd_rn_destroy_buffer(positions_gpu);
+    shd_rn_destroy_buffer(attributes_gpu);
     shd_rn_destroy_buffer(materials_gpu);
     shd_rn_destroy_buffer(emitters_gpu);
+    if (spheres_gpu)
+        shd_rn_destroy_buffer(spheres_gpu);
+    if (sphere_materials_gpu)
+        shd_rn_destroy_buffer(sphere_materials_gpu);
     if (textures_gpu)
         shd_rn_destroy_buffer(textures_gpu);
     if (texture_data_gpu)
@@ -7,18 +7,66 @@
 #include "emitter.h"
 #include "texture.h"
 #include "camera.h"
+#include "bvh.h"
 
 #include <string>
 
+// A range of `Model::triangles` sharing one object space
+struct Mesh {
+    int first_triangle;
+    int triangle_count;
+};
+
+// Quantizes the attributes of a vertex, see VertexAttributes
+VertexAttributes encode_vertex_attributes(vec3 normal, vec2 texcoords);
+
 struct Model {
-    Model(const char* path, shady::Device*);
+    // With `instancing`, every mesh is kept once in object space and placed by instances, otherwise all the triangles
+    // are moved to world space and there are no meshes or instances. Point clouds become spheres of `point_radius`, or
+    // of a radius derived from their density if it is 0. They are skipped with `instancing`.
+    Model(const char* path, shady::Device*, bool instancing = false, float point_radius = 0);
     ~Model();
 
-    // int triangles_count = 0;
-    // Triangle* triangles_host;
-    std::vector<Triangle> triangles;
+    // Indexed triangles, see Geometry. The prim_id of a triangle is its index in `triangles`.
+    std::vector<IndexedTriangle> triangles;
     shady::Buffer* triangles_gpu = nullptr;
 
+    std::vector<vec3> positions;
+    shady::Buffer* positions_gpu = nullptr;
+    // Empty unless filled by the caller, reorder_triangles then moves it along with the vertices. Lets animations keep
+    // addressing vertices by the index they had when it was filled.
+    std::vector<int> vertex_ids;
+
+    std::vector<VertexAttributes> attributes;
+    shady::Buffer* attributes_gpu = nullptr;
+
+    // Spheres made from the points of point clouds, with one material each. Their prim_id is their index with
+    // PRIM_SPHERE_BIT set.
+    std::vector<Sphere> spheres;
+    shady::Buffer* spheres_gpu = nullptr;
+
+    std::vector<int> sphere_materials;
+    shady::Buffer* sphere_materials_gpu = nullptr;
+
+    // The arrays above, as seen from the host or from the device
+    Geometry host_geometry() const;
+    Geometry gpu_geometry() const;
+
+    // Moves triangle `order[i]` to position i, so that triangles hit together are stored together, and renumbers the
+    // emitters to match. Vertices are moved into the order the triangles first use them. The order has to keep every
+    // mesh in its range. Everything that changed is uploaded again.
+    void reorder_triangles(const std::vector<int>& order);
+    // Same for the spheres, which are moved into leaf order as they are
+    void reorder_spheres(const std::vector<int>& order);
+    // Caches the normal of each emitter and builds the alias table that picks them in proportion to emission times
+    // area. Sets Emitter::pdf and Material::emitter_pdf to match.
+    void build_emitter_table();
+    // Frees the host side of the geometry and textures, once nothing renders on the host anymore
+    void release_host_copies();
+
+    std::vector<Mesh> meshes;
+    std::vector<Instance> instances;
+
     std::vector<Material> materials;
     shady::Buffer* materials_gpu = nullptr;
 
@@ -33,6 +81,8 @@ struct Model {
     shady::Buffer* textures_gpu = nullptr;
 
     Camera loaded_camera;
+
+    shady::Device* device;
 };
 
 #endif
@@ -0,0 +1,187 @@
+#include "wavefront_host.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+extern "C" {
+
+thread_local extern vec2 gl_GlobalInvocationID;
+RA_WAVEFRONT_GENERATE_SIGNATURE;
+RA_WAVEFRONT_EXTEND_SIGNATURE;
+RA_WAVEFRONT_BIN_SIGNATURE;
+RA_WAVEFRONT_SORT_SIGNATURE;
+RA_WAVEFRONT_SHADE_SIGNATURE;
+RA_WAVEFRONT_CONNECT_SIGNATURE;
+RA_WAVEFRONT_ACCUMULATE_SIGNATURE;
+
+}
+
+template<typename T>
+static T* device_address(shady::Buffer* buffer) {
+    return reinterpret_cast<T*>(shd_rn_get_buffer_device_pointer(buffer));
+}
+
+template<typename T>
+static void reallocate(shady::Device* device, shady::Buffer*& buffer, int count) {
+    if (buffer)
+        shd_rn_destroy_buffer(buffer);
+    buffer = shd_rn_allocate_buffer_device(device, sizeof(T) * count);
+}
+
+// Sets gl_GlobalInvocationID for each thread of a kernel launched over `width` x `height` threads, on the CPU
+template<typename F>
+static void run_on_host(int width, int height, F kernel) {
+    #pragma omp parallel for
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) {
+            gl_GlobalInvocationID.x = x;
+            gl_GlobalInvocationID.y = y;
+            kernel();
+        }
+    }
+}
+
+WavefrontHost::WavefrontHost(shady::Device* device) : device(device) {}
+
+WavefrontHost::~WavefrontHost() {
+    for (shady::Buffer* buffer : { gpu_paths, gpu_rays, gpu_hits, gpu_next_rays, gpu_shadow_rays, gpu_counters, gpu_shade_order, gpu_material_bins }) {
+        if (buffer)
+            shd_rn_destroy_buffer(buffer);
+    }
+}
+
+void WavefrontHost::reserve(int new_capacity, bool gpu) {
+    material_bins.resize(material_count + 1);
+    if (gpu) {
+        if (material_count + 1 > gpu_material_bins_size) {
+            gpu_material_bins_size = material_count + 1;
+            reallocate<uint32_t>(device, gpu_material_bins, gpu_material_bins_size);
+        }
+        if (new_capacity <= gpu_capacity)
+            return;
+        gpu_capacity = new_capacity;
+        reallocate<WavefrontPath>(device, gpu_paths, gpu_capacity);
+        reallocate<int>(device, gpu_rays, gpu_capacity);
+        reallocate<Hit>(device, gpu_hits, gpu_capacity);
+        reallocate<int>(device, gpu_next_rays, gpu_capacity);
+        reallocate<WavefrontShadowRay>(device, gpu_shadow_rays, gpu_capacity);
+        reallocate<uint32_t>(device, gpu_counters, WAVEFRONT_COUNTERS);
+        reallocate<int>(device, gpu_shade_order, gpu_capacity);
+    } else {
+        if (new_capacity <= capacity)
+            return;
+        capacity = new_capacity;
+        paths.resize(capacity);
+        rays.resize(capacity);
+        hits.resize(capacity);
+        next_rays.resize(capacity);
+        shadow_rays.resize(capacity);
+        shade_order.resize(capacity);
+    }
+}
+
+uint64_t WavefrontHost::render(shady::Program* program, RA_RENDERER_PARAMS) {
+    bool gpu = program != nullptr;
+    reserve(width * height, gpu);
+
+    WavefrontQueues queues;
+    if (gpu) {
+        queues = WavefrontQueues {
+            .paths = device_address<WavefrontPath>(gpu_paths),
+            .rays = device_address<int>(gpu_rays),
+            .hits = device_address<Hit>(gpu_hits),
+            .next_rays = device_address<int>(gpu_next_rays),
+            .shadow_rays = device_address<WavefrontShadowRay>(gpu_shadow_rays),
+            .counters = device_address<uint32_t>(gpu_counters),
+            .shade_order = sort_materials ? device_address<int>(gpu_shade_order) : nullptr,
+            .material_bins = device_address<uint32_t>(gpu_material_bins),
+        };
+    } else {
+        queues = WavefrontQueues {
+            .paths = paths.data(),
+            .rays = rays.data(),
+            .hits = hits.data(),
+            .next_rays = next_rays.data(),
+            .shadow_rays = shadow_rays.data(),
+            .counters = counters,
+            .shade_order = sort_materials ? shade_order.data() : nullptr,
+            .material_bins = material_bins.data(),
+        };
+    }
+
+    uint64_t gpu_time = 0;
+    auto launch = [&](const char* kernel, int groups_x, int groups_y, std::vector<void*> args) {
+        uint64_t kernel_time = 0;
+        shady::ExtraKernelOptions launch_options = {
+            .profiled_gpu_time = &kernel_time,
+        };
+        shd_rn_wait_completion(shd_rn_launch_kernel(program, device, kernel, groups_x, groups_y, 1, args.size(), args.data(), &launch_options));
+        gpu_time += kernel_time;
+    };
+    auto groups = [](int count) { return (count + WAVEFRONT_LOCAL_SIZE - 1) / WAVEFRONT_LOCAL_SIZE; };
+
+    for (int sample = 0; sample < spp; sample++) {
+        if (gpu)
+            launch("wavefront_generate", (width + 15) / 16, (height + 15) / 16, { &cam, &width, &height, &accum, &sample, &queues });
+        else
+            run_on_host(width, height, [&]() { wavefront_generate(cam, width, height, accum, sample, queues); });
+
+        int count = width * height;
+        while (count > 0) {
+            memset(counters, 0, sizeof(counters));
+            if (gpu) {
+                shd_rn_copy_to_buffer(gpu_counters, 0, counters, sizeof(counters));
+                launch("wavefront_extend", groups(count), 1, { &count, &bvh, &queues });
+            } else {
+                run_on_host(count, 1, [&]() { wavefront_extend(count, bvh, queues); });
+            }
+
+            if (sort_materials) {
+                // Counting sort: the counts of the bins become the first slot of each bin, on the host since there are few
+                std::fill(material_bins.begin(), material_bins.end(), 0);
+                if (gpu) {
+                    shd_rn_copy_to_buffer(gpu_material_bins, 0, material_bins.data(), sizeof(uint32_t) * material_bins.size());
+                    launch("wavefront_bin_materials", groups(count), 1, { &count, &geometry, &bvh, &queues });
+                    shd_rn_copy_from_buffer(gpu_material_bins, 0, material_bins.data(), sizeof(uint32_t) * material_bins.size());
+                } else {
+                    run_on_host(count, 1, [&]() { wavefront_bin_materials(count, geometry, bvh, queues); });
+                }
+                uint32_t offset = 0;
+                for (uint32_t& bin : material_bins)
+                    offset += std::exchange(bin, offset);
+                if (gpu) {
+                    shd_rn_copy_to_buffer(gpu_material_bins, 0, material_bins.data(), sizeof(uint32_t) * material_bins.size());
+                    launch("wavefront_sort_materials", groups(count), 1, { &count, &geometry, &bvh, &queues });
+                } else {
+                    run_on_host(count, 1, [&]() { wavefront_sort_materials(count, geometry, bvh, queues); });
+                }
+            }
+
+            if (gpu) {
+                launch("wavefront_shade", groups(count), 1, { &count, &geometry, &materials, &nlights, &emitters, &bvh, &texture_descriptors, &texture_data, &mode, &max_depth, &queues });
+                shd_rn_copy_from_buffer(gpu_counters, 0, counters, sizeof(counters));
+            } else {
+                run_on_host(count, 1, [&]() { wavefront_shade(count, geometry, materials, nlights, emitters, bvh, texture_descriptors, texture_data, mode, max_depth, queues); });
+            }
+
+            int shadow_count = counters[WAVEFRONT_SHADOW_RAYS];
+            rays_traced += count + shadow_count;
+            if (shadow_count > 0) {
+                if (gpu)
+                    launch("wavefront_connect", groups(shadow_count), 1, { &shadow_count, &bvh, &queues });
+                else
+                    run_on_host(shadow_count, 1, [&]() { wavefront_connect(shadow_count, bvh, queues); });
+            }
+
+            count = counters[WAVEFRONT_NEXT_RAYS];
+            std::swap(queues.rays, queues.next_rays);
+        }
+    }
+
+    if (gpu)
+        launch("wavefront_accumulate", (width + 15) / 16, (height + 15) / 16, { &width, &height, &fb, &film, &accum, &spp, &queues });
+    else
+        run_on_host(width, height, [&]() { wavefront_accumulate(width, height, fb, film, accum, spp, queues); });
+    return gpu_time;
+}
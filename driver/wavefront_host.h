@@ -0,0 +1,52 @@
+#ifndef RA_WAVEFRONT_HOST_H
+#define RA_WAVEFRONT_HOST_H
+
+#include "host.h"
+#include "wavefront.h"
+
+#include <cstdint>
+#include <vector>
+
+// Runs the kernels of wavefront.h, on the CPU or through the runner, and keeps the queues they need between frames
+struct WavefrontHost {
+    WavefrontHost(shady::Device*);
+    ~WavefrontHost();
+
+    // Grows the queues to hold `capacity` paths, on the device or on the host
+    void reserve(int capacity, bool gpu);
+    // Renders one sample per pixel. Runs the kernels from `program` if there is one, in which case all the pointers
+    // have to be device addresses, and returns the time the device spent in them. The kernels need device atomics,
+    // see atomic_increment, and have not been run on a device yet.
+    uint64_t render(shady::Program* program, RA_RENDERER_PARAMS);
+
+    shady::Device* device;
+    // Shade the hits of each bounce grouped by material, needs material_count to be set
+    bool sort_materials = false;
+    int material_count = 0;
+    // Rays traced by all the calls to `render`, shadow rays included
+    uint64_t rays_traced = 0;
+
+    std::vector<WavefrontPath> paths;
+    std::vector<int> rays;
+    std::vector<Hit> hits;
+    std::vector<int> next_rays;
+    std::vector<WavefrontShadowRay> shadow_rays;
+    std::vector<int> shade_order;
+    // Also where the bins of the device are counted and turned into offsets
+    std::vector<uint32_t> material_bins;
+    uint32_t counters[WAVEFRONT_COUNTERS];
+    int capacity = 0;
+
+    shady::Buffer* gpu_paths = nullptr;
+    shady::Buffer* gpu_rays = nullptr;
+    shady::Buffer* gpu_hits = nullptr;
+    shady::Buffer* gpu_next_rays = nullptr;
+    shady::Buffer* gpu_shadow_rays = nullptr;
+    shady::Buffer* gpu_counters = nullptr;
+    shady::Buffer* gpu_shade_order = nullptr;
+    shady::Buffer* gpu_material_bins = nullptr;
+    int gpu_capacity = 0;
+    int gpu_material_bins_size = 0;
+};
+
+#endif
@@ -5,4 +5,5 @@
 #include "ao.cpp"
 #include "pt.cpp"
 
-#include "renderer.cpp"
\ No newline at end of file
+#include "renderer.cpp"
+#include "wavefront.cpp"
\ No newline at end of file
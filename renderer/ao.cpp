@@ -3,18 +3,21 @@
 #include "sampling.h"
 #include "shading.h"
 
-RA_FUNCTION vec3 pathtrace_ao(RNGState* rng, BVH& bvh, const Triangle* tris, Ray ray) {
+RA_FUNCTION vec3 pathtrace_ao(RNGState* rng, BVH& bvh, const Geometry& geometry, Ray ray) {
+    Hit hit { .t = ray.tmax };
+    bool found = bvh.intersect(ray, hit);
+    return pathtrace_ao_hit(rng, bvh, geometry, ray, found, hit);
+}
+
+RA_FUNCTION vec3 pathtrace_ao_hit(RNGState* rng, BVH& bvh, const Geometry& geometry, Ray ray, bool found, Hit hit) {
     const float offset = 0.001f;
 
-    vec3 contrib = vec3(0);
-    
-    Hit hit { .t = ray.tmax };
-    if (bvh.intersect(ray, hit)) {
-        Triangle tri = tris[hit.prim_id];
+    if (found) {
+        SurfacePoint surface = bvh.get_surface(geometry, ray, hit);
 
-        vec3 n = tri.get_vertex_normal(hit.primary);
+        vec3 n = surface.normal;
         vec3 fn = ray.dir.dot(n) > 0 ? -n : n; // Ensure normal is facing forward
-        vec3 p = tri.get_position(hit.primary);
+        vec3 p = surface.position;
         auto frame = shading::make_shading_frame(fn);
 
         auto sample = shading::sample_cosine_hemisphere(randf(rng), randf(rng));
@@ -26,8 +29,7 @@ RA_FUNCTION vec3 pathtrace_ao(RNGState* rng, BVH& bvh, const Triangle* tris, Ray
         bounced_ray.tmax = 1.0e+17f;
 
         // AO only bounces once
-        hit = Hit{ .t = ray.tmax };
-        if (bvh.intersect(bounced_ray, hit))
+        if (bvh.intersect_shadow(bounced_ray))
             return vec3(0);
         else
             return vec3(fabs(sample.dir.z/*cosine*/)) / sample.pdf;
@@ -4,5 +4,6 @@
 #include "bvh.h"
 #include "random.h"
 
-RA_FUNCTION vec3 pathtrace_ao(RNGState* rng, BVH& bvh, const Triangle* tris, Ray ray);
+RA_FUNCTION vec3 pathtrace_ao(RNGState* rng, BVH& bvh, const Geometry& geometry, Ray ray);
+RA_FUNCTION vec3 pathtrace_ao_hit(RNGState* rng, BVH& bvh, const Geometry& geometry, Ray ray, bool found, Hit hit);
 #endif
\ No newline at end of file
@@ -1,13 +1,290 @@
 #include "bvh.h"
 
-RA_METHOD bool BVH::intersect(Ray ray, Hit& hit, bool return_early, int* iteration_count) {
-    int stack[32];
+RA_METHOD BBox BVH::Node::get_child_box(int i) const {
+    uint32_t qmin = child_min[i];
+    uint32_t qmax = child_max[i];
+    vec3 min = vec3((float) (qmin & 0xFF), (float) ((qmin >> 8) & 0xFF), (float) ((qmin >> 16) & 0xFF));
+    vec3 max = vec3((float) (qmax & 0xFF), (float) ((qmax >> 8) & 0xFF), (float) ((qmax >> 16) & 0xFF));
+    return BBox { origin + min * scale, origin + max * scale };
+}
+
+RA_FUNCTION static vec3 transform_point(const vec3 m[4], vec3 p) {
+    return m[0] * p.x + m[1] * p.y + m[2] * p.z + m[3];
+}
+
+RA_FUNCTION static vec3 transform_dir(const vec3 m[4], vec3 d) {
+    return m[0] * d.x + m[1] * d.y + m[2] * d.z;
+}
+
+// Normals go through the inverse transpose, whose rows are the columns of the inverse
+RA_FUNCTION static vec3 transform_normal(const vec3 inverse[4], vec3 n) {
+    return normalize(vec3(inverse[0].dot(n), inverse[1].dot(n), inverse[2].dot(n)));
+}
+
+RA_METHOD Ray Instance::to_object_ray(Ray ray) const {
+    ray.origin = transform_point(to_object, ray.origin);
+    ray.dir = transform_dir(to_object, ray.dir);
+    return ray;
+}
+
+RA_METHOD Triangle Instance::to_world_triangle(Triangle tri) const {
+    tri.v0 = transform_point(to_world, tri.v0);
+    tri.v1 = transform_point(to_world, tri.v1);
+    tri.v2 = transform_point(to_world, tri.v2);
+    tri.n0 = transform_normal(to_object, tri.n0);
+    tri.n1 = transform_normal(to_object, tri.n1);
+    tri.n2 = transform_normal(to_object, tri.n2);
+    return tri;
+}
+
+RA_METHOD Triangle BVH::get_triangle(const Geometry& geometry, int prim_id, int inst_id) const {
+    if (inst_id < 0)
+        return geometry.get_triangle(prim_id);
+    return instances[inst_id].to_world_triangle(geometry.get_triangle(prim_id));
+}
+
+RA_METHOD SurfacePoint BVH::get_surface(const Geometry& geometry, const Ray& ray, const Hit& hit) const {
+    SurfacePoint surface;
+    if (prim_is_sphere(hit.prim_id)) {
+        int index = hit.prim_id & ~PRIM_SPHERE_BIT;
+        surface.position = ray.origin + ray.dir * hit.t;
+        surface.normal = geometry.spheres[index].get_normal(hit.primary);
+        surface.face_normal = surface.normal;
+        // The octahedral mapping of the normal doubles as the texture coordinates
+        surface.texcoords = hit.primary * 0.5f + vec2(0.5f);
+        surface.mat_id = geometry.sphere_materials[index];
+        surface.area = 0.0f;
+        return surface;
+    }
+    Triangle tri = get_triangle(geometry, hit.prim_id, hit.inst_id);
+    surface.position = tri.get_position(hit.primary);
+    surface.normal = tri.get_vertex_normal(hit.primary);
+    surface.face_normal = tri.get_face_normal();
+    surface.texcoords = tri.get_texcoords(hit.primary);
+    surface.mat_id = tri.mat_id;
+    surface.area = tri.get_area();
+    return surface;
+}
+
+RA_METHOD int BVH::get_material(const Geometry& geometry, const Hit& hit) const {
+    if (prim_is_sphere(hit.prim_id))
+        return geometry.sphere_materials[hit.prim_id & ~PRIM_SPHERE_BIT];
+    return geometry.triangles[hit.prim_id].mat_id;
+}
+
+// Switches the ray of a traversal between world space and the object space of an instance, without any recursion into
+// a second traversal. Distances along the ray are the same in both spaces, so the current ray.tmax carries over.
+RA_FUNCTION static void switch_ray(Ray next, Ray& ray, vec3& inverted_ray_dir, vec3& morigin_t_riv) {
+    next.tmax = ray.tmax;
+    ray = next;
+    inverted_ray_dir = vec3(1.0f) / ray.dir;
+    morigin_t_riv = -ray.origin * inverted_ray_dir;
+}
+
+#ifdef BVH_LEAF_BLOCKS
+// GCC/Clang vector extensions, one lane per primitive of a TriangleBlock
+typedef float BlockFloat __attribute__((vector_size(BVH_LEAF_BLOCK_SIZE * sizeof(float))));
+typedef int BlockInt __attribute__((vector_size(BVH_LEAF_BLOCK_SIZE * sizeof(int))));
+
+static inline BlockFloat load_block(const float* f) {
+    BlockFloat v;
+    __builtin_memcpy(&v, f, sizeof(v));
+    return v;
+}
+
+// Same as TriangleIsect::intersect for a whole block, except for the test against ray.tmax which the callers do per lane
+static inline BlockInt intersect_block(const TriangleBlock& block, const Ray& ray, BlockFloat& t, BlockFloat& u, BlockFloat& v) {
+    BlockFloat e1x = load_block(block.e1[0]), e1y = load_block(block.e1[1]), e1z = load_block(block.e1[2]);
+    BlockFloat e2x = load_block(block.e2[0]), e2y = load_block(block.e2[1]), e2z = load_block(block.e2[2]);
+
+    BlockFloat px = ray.dir.y * e2z - ray.dir.z * e2y;
+    BlockFloat py = ray.dir.z * e2x - ray.dir.x * e2z;
+    BlockFloat pz = ray.dir.x * e2y - ray.dir.y * e2x;
+    BlockFloat det = e1x * px + e1y * py + e1z * pz;
+    BlockInt valid = ~((det > -1e-8f) & (det < 1e-8f));
+    BlockFloat inv_det = 1 / det;
+
+    BlockFloat tx = ray.origin.x - load_block(block.v0[0]);
+    BlockFloat ty = ray.origin.y - load_block(block.v0[1]);
+    BlockFloat tz = ray.origin.z - load_block(block.v0[2]);
+    u = (tx * px + ty * py + tz * pz) * inv_det;
+    valid &= ~((u < 0) | (u > 1));
+
+    BlockFloat qx = ty * e1z - tz * e1y;
+    BlockFloat qy = tz * e1x - tx * e1z;
+    BlockFloat qz = tx * e1y - ty * e1x;
+    v = (ray.dir.x * qx + ray.dir.y * qy + ray.dir.z * qz) * inv_det;
+    valid &= ~((v < 0) | (u + v > 1));
+
+    t = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+    valid &= ~((t < epsilon) | (t < ray.tmin));
+    return valid;
+}
+
+RA_METHOD bool BVH::intersect_leaf_blocks(uint32_t start, uint32_t count, Ray& ray, Hit& hit, bool return_early) {
+    bool hit_something = false;
+    for (uint32_t first = 0; first < count; first += BVH_LEAF_BLOCK_SIZE) {
+        const TriangleBlock& block = blocks[(start + first) / BVH_LEAF_BLOCK_SIZE];
+        BlockFloat t, u, v;
+        BlockInt valid = intersect_block(block, ray, t, u, v);
+        // Lanes are accepted in the same order as the scalar loop, so that ties go to the same primitive
+        for (uint32_t lane = 0; lane < BVH_LEAF_BLOCK_SIZE && first + lane < count; lane++) {
+            if (!valid[lane] || t[lane] > ray.tmax)
+                continue;
+            hit.t = t[lane];
+            hit.primary = vec2(u[lane], v[lane]);
+            hit.prim_id = block.prim_id[lane];
+            hit_something = true;
+            if (return_early)
+                return true;
+            ray.tmax = hit.t;
+        }
+    }
+    return hit_something;
+}
+
+RA_METHOD bool BVH::occluded_leaf_blocks(uint32_t start, uint32_t count, Ray ray) {
+    for (uint32_t first = 0; first < count; first += BVH_LEAF_BLOCK_SIZE) {
+        BlockFloat t, u, v;
+        BlockInt valid = intersect_block(blocks[(start + first) / BVH_LEAF_BLOCK_SIZE], ray, t, u, v);
+        valid &= t <= ray.tmax;
+        for (uint32_t lane = 0; lane < BVH_LEAF_BLOCK_SIZE && first + lane < count; lane++) {
+            if (valid[lane])
+                return true;
+        }
+    }
+    return false;
+}
+#endif
+
+RA_METHOD bool BVH::intersect_leaf(uint32_t leaf, Ray& ray, Hit& hit, bool return_early) {
+    uint32_t start = bvh_leaf_start(leaf);
+    uint32_t count = bvh_leaf_count(leaf);
+    if (bvh_leaf_is_spheres(leaf)) {
+        bool hit_something = false;
+        for (uint32_t i = 0; i < count; i++) {
+            if (spheres[start + i].intersect(ray, hit)) {
+                hit.prim_id = (start + i) | PRIM_SPHERE_BIT;
+                hit_something = true;
+                if (return_early)
+                    return true;
+                ray.tmax = hit.t;
+            }
+        }
+        return hit_something;
+    }
+#ifdef BVH_LEAF_BLOCKS
+    if (blocks)
+        return intersect_leaf_blocks(start, count, ray, hit, return_early);
+#endif
+    bool hit_something = false;
+    for (uint32_t i = 0; i < count; i++) {
+        size_t iindex = start + i;
+#ifndef BVH_REORDER_TRIS
+        size_t tindex = indices[iindex];
+#else
+        size_t tindex = iindex;
+#endif
+        if (tris[tindex].intersect(ray, hit)) {
+            hit_something = true;
+            if (return_early)
+                return true;
+            ray.tmax = hit.t;
+        }
+    }
+    return hit_something;
+}
+
+RA_METHOD bool BVH::occluded_leaf(uint32_t leaf, Ray ray) {
+    uint32_t start = bvh_leaf_start(leaf);
+    uint32_t count = bvh_leaf_count(leaf);
+    if (bvh_leaf_is_spheres(leaf)) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (spheres[start + i].occludes(ray))
+                return true;
+        }
+        return false;
+    }
+#ifdef BVH_LEAF_BLOCKS
+    if (blocks)
+        return occluded_leaf_blocks(start, count, ray);
+#endif
+    for (uint32_t i = 0; i < count; i++) {
+#ifndef BVH_REORDER_TRIS
+        if (tris[indices[start + i]].occludes(ray))
+#else
+        if (tris[start + i].occludes(ray))
+#endif
+            return true;
+    }
+    return false;
+}
+
+RA_METHOD bool BVH::occluded(Ray ray) {
+    uint32_t stack[BVH_INSTANCE_STACK_SIZE];
     int stack_size = 0;
 
     vec3 inverted_ray_dir = vec3(1.0f) / ray.dir;
     vec3 morigin_t_riv = -ray.origin * inverted_ray_dir;
 
-    auto isect = [&](BBox& box, float& distance) {
+    // Set while in the tree of an instanced mesh, which ends at the BVH_INSTANCE_EXIT entry pushed when entering it
+    bool in_instance = false;
+    Ray world_ray = ray;
+    uint32_t id = root;
+    for (int k = 0; k < BVH_MAX_ITERATIONS; k++) {
+        if (id == BVH_INSTANCE_EXIT) {
+            switch_ray(world_ray, ray, inverted_ray_dir, morigin_t_riv);
+            in_instance = false;
+        } else if (bvh_is_leaf(id) && instances && !in_instance) {
+            const Instance& instance = instances[bvh_leaf_start(id)];
+            stack[stack_size++] = BVH_INSTANCE_EXIT;
+            switch_ray(instance.to_object_ray(world_ray), ray, inverted_ray_dir, morigin_t_riv);
+            in_instance = true;
+            id = instance.root;
+            continue;
+        } else if (bvh_is_leaf(id)) {
+            if (occluded_leaf(id, ray))
+                return true;
+        } else {
+            Node n = nodes[id];
+
+            // Visit the children front to back along the axis they are sorted on, according to the ray direction
+            bool reverse = ray.dir.arr[n.get_order_axis()] < 0;
+            uint32_t next = BVH_EMPTY_CHILD;
+            for (int j = 0; j < BVH_ARITY; j++) {
+                int i = reverse ? j : BVH_ARITY - 1 - j;
+                uint32_t child = n.children[i];
+                if (child == BVH_EMPTY_CHILD)
+                    continue;
+                float bbox_t[2];
+                n.get_child_box(i).intersect_range(ray, inverted_ray_dir, morigin_t_riv, bbox_t);
+                if (!(bbox_t[0] <= bbox_t[1] && bbox_t[1] > 0 && bbox_t[0] < ray.tmax))
+                    continue;
+                if (next != BVH_EMPTY_CHILD)
+                    stack[stack_size++] = next;
+                next = child;
+            }
+
+            if (next != BVH_EMPTY_CHILD) {
+                id = next;
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            break;
+        id = stack[--stack_size];
+    }
+    return false;
+}
+
+RA_METHOD bool BVH::intersect_stack(Ray ray, Hit& hit, bool return_early, int* iteration_count) {
+    uint32_t stack[BVH_INSTANCE_STACK_SIZE];
+    int stack_size = 0;
+
+    vec3 inverted_ray_dir = vec3(1.0f) / ray.dir;
+    vec3 morigin_t_riv = -ray.origin * inverted_ray_dir;
+
+    auto isect = [&](BBox box, float& distance) {
         float bbox_t[2];
         box.intersect_range(ray, inverted_ray_dir, morigin_t_riv, bbox_t);
         distance = bbox_t[0];
@@ -15,65 +292,59 @@ RA_METHOD bool BVH::intersect(Ray ray, Hit& hit, bool return_early, int* iterati
     };
 
     bool hit_something = false;
-    int id = root;
-    int max_iter = 256;
+    // Instance whose mesh is being traversed, its tree ends at the BVH_INSTANCE_EXIT entry pushed when entering it
+    int inst_id = -1;
+    Ray world_ray = ray;
+    uint32_t id = root;
     int k;
-    for (k = 0; k < max_iter; k++) {
-        Node n = nodes[id];
-        float d;
-        if (true || isect(n.box, d)) {
-            if (n.is_leaf) {
-                for (int i = 0; i < n.leaf.count; i++) {
-                    size_t iindex = n.leaf.start + i;
-#ifndef BVH_REORDER_TRIS
-                    size_t tindex = indices[iindex];
-#else
-                    size_t tindex = iindex;
-#endif
-                    if (tris[tindex].intersect(ray, hit)) {
-                        if (return_early) {
-                            *iteration_count = k;
-                            return true;
-                        }
-                        hit_something = true;
-                        ray.tmax = hit.t;
-                    }
+    for (k = 0; k < BVH_MAX_ITERATIONS; k++) {
+        if (id == BVH_INSTANCE_EXIT) {
+            switch_ray(world_ray, ray, inverted_ray_dir, morigin_t_riv);
+            inst_id = -1;
+        } else if (bvh_is_leaf(id) && instances && inst_id < 0) {
+            inst_id = bvh_leaf_start(id);
+            stack[stack_size++] = BVH_INSTANCE_EXIT;
+            world_ray = ray;
+            switch_ray(instances[inst_id].to_object_ray(ray), ray, inverted_ray_dir, morigin_t_riv);
+            id = instances[inst_id].root;
+            continue;
+        } else if (bvh_is_leaf(id)) {
+            if (intersect_leaf(id, ray, hit, return_early)) {
+                hit_something = true;
+                hit.inst_id = inst_id;
+                if (return_early) {
+                    *iteration_count = k;
+                    return true;
                 }
-            } else {
-                int left_child = n.inner.children[0];
-                float left_d;
-                bool left_hit = isect(nodes[left_child].box, left_d);
-
-                int right_child = n.inner.children[1];
-                float right_d;
-                bool right_hit = isect(nodes[right_child].box, right_d);
-
-                if (left_hit && right_hit) {
-                    int closest_child = right_d < left_d;
-                    id = n.inner.children[closest_child];
-                    stack[stack_size++] = n.inner.children[1 - closest_child];
-                    continue;
-                } else if (left_hit) {
-                    id = left_child;
+            }
+        } else {
+            Node n = nodes[id];
+
+            // Test all the child boxes and sort the hit ones from farthest to closest
+            uint32_t hit_children[BVH_ARITY];
+            float hit_distances[BVH_ARITY];
+            int hit_count = 0;
+            for (int i = 0; i < BVH_ARITY; i++) {
+                uint32_t child = n.children[i];
+                if (child == BVH_EMPTY_CHILD)
                     continue;
-                } else if (right_hit) {
-                    id = right_child;
+                float child_d;
+                if (!isect(n.get_child_box(i), child_d))
                     continue;
+                int j = hit_count++;
+                for (; j > 0 && hit_distances[j - 1] <= child_d; j--) {
+                    hit_distances[j] = hit_distances[j - 1];
+                    hit_children[j] = hit_children[j - 1];
                 }
+                hit_distances[j] = child_d;
+                hit_children[j] = child;
+            }
 
-                /*float bbox_t[2];
-                n.box.intersect_range(ray, inverted_ray_dir, bbox_t);
-                if (bbox_t[0] <= bbox_t[1] && bbox_t[1] > 0 && bbox_t[0] < ray.tmax) {
-                    //for (int i = 0; i < BVH_ARITY - 1; i++) {
-                    //    stack[stack_size++] = &nodes[n->inner.children[i]];
-                    //    //if (nodes[n->inner.children[i]].is_leaf)
-                    //        //return bbox_hit;
-                    //}
-                    //n = &nodes[n->inner.children[BVH_ARITY - 1]];
-                    stack[stack_size++] = n.inner.children[0];
-                    id = n.inner.children[1];
-                    continue;
-                }*/
+            if (hit_count > 0) {
+                for (int i = 0; i < hit_count - 1; i++)
+                    stack[stack_size++] = hit_children[i];
+                id = hit_children[hit_count - 1];
+                continue;
             }
         }
         if (stack_size == 0)
@@ -82,4 +353,117 @@ RA_METHOD bool BVH::intersect(Ray ray, Hit& hit, bool return_early, int* iterati
     }
     *iteration_count = k;
     return hit_something;
-}
\ No newline at end of file
+}
+
+RA_METHOD bool BVH::intersect_stackless(Ray ray, Hit& hit, bool return_early, int* iteration_count) {
+    vec3 inverted_ray_dir = vec3(1.0f) / ray.dir;
+    vec3 morigin_t_riv = -ray.origin * inverted_ray_dir;
+
+    auto isect = [&](BBox box, float& distance) {
+        float bbox_t[2];
+        box.intersect_range(ray, inverted_ray_dir, morigin_t_riv, bbox_t);
+        distance = bbox_t[0];
+        return (bbox_t[0] <= bbox_t[1] && bbox_t[1] > 0 && bbox_t[0] < ray.tmax);
+    };
+
+    // A lone leaf takes a single step, which the stack traversal does as well
+    if (bvh_is_leaf(root))
+        return intersect_stack(ray, hit, return_early, iteration_count);
+
+    // The children of a node are visited by increasing (entry distance, slot), which can be recomputed at any time
+    // since it does not depend on ray.tmax. The whole traversal state is the current node and the last child visited.
+    // Inside an instance, the root is that of its mesh, and the leaf of the instance is kept to resume the top level
+    // tree after it.
+    bool hit_something = false;
+    uint32_t id = root;
+    uint32_t tree_root = root;
+    float last_d = -__FLT_MAX__;
+    int last_slot = -1;
+    int inst_id = -1;
+    uint32_t inst_node = 0;
+    int inst_slot = -1;
+    Ray world_ray = ray;
+    int k;
+    for (k = 0; k < BVH_MAX_ITERATIONS; k++) {
+        Node n = nodes[id];
+
+        int next_slot = -1;
+        float next_d = __FLT_MAX__;
+        for (int i = 0; i < BVH_ARITY; i++) {
+            if (n.children[i] == BVH_EMPTY_CHILD)
+                continue;
+            float child_d;
+            if (!isect(n.get_child_box(i), child_d))
+                continue;
+            bool after_last = child_d > last_d || (child_d == last_d && i > last_slot);
+            bool before_next = next_slot < 0 || child_d < next_d;
+            if (after_last && before_next) {
+                next_slot = i;
+                next_d = child_d;
+            }
+        }
+
+        if (next_slot < 0 && id == tree_root && inst_id >= 0) {
+            // Done with the mesh, resume the top level tree after the leaf of the instance
+            switch_ray(world_ray, ray, inverted_ray_dir, morigin_t_riv);
+            inst_id = -1;
+            tree_root = root;
+            id = inst_node;
+            last_slot = inst_slot;
+            isect(nodes[id].get_child_box(last_slot), last_d);
+            continue;
+        }
+        if (next_slot < 0) {
+            // All children are done, resume the parent after the slot we came from
+            if (id == root)
+                break;
+            uint32_t parent = parents[id];
+            id = parent >> BVH_PARENT_SLOT_BITS;
+            last_slot = parent & ((1 << BVH_PARENT_SLOT_BITS) - 1);
+            isect(nodes[id].get_child_box(last_slot), last_d);
+            continue;
+        }
+
+        uint32_t child = n.children[next_slot];
+        if (bvh_is_leaf(child) && instances && inst_id < 0) {
+            inst_id = bvh_leaf_start(child);
+            inst_node = id;
+            inst_slot = next_slot;
+            world_ray = ray;
+            switch_ray(instances[inst_id].to_object_ray(ray), ray, inverted_ray_dir, morigin_t_riv);
+            if (bvh_is_leaf(instances[inst_id].root)) {
+                // A mesh small enough to be a single leaf has no tree to enter, it is tested right away instead
+                if (intersect_leaf(instances[inst_id].root, ray, hit, return_early)) {
+                    hit_something = true;
+                    hit.inst_id = inst_id;
+                    if (return_early)
+                        break;
+                }
+                switch_ray(world_ray, ray, inverted_ray_dir, morigin_t_riv);
+                inst_id = -1;
+                last_d = next_d;
+                last_slot = next_slot;
+            } else {
+                tree_root = instances[inst_id].root;
+                id = tree_root;
+                last_d = -__FLT_MAX__;
+                last_slot = -1;
+            }
+        } else if (bvh_is_leaf(child)) {
+            if (intersect_leaf(child, ray, hit, return_early)) {
+                hit_something = true;
+                hit.inst_id = inst_id;
+                if (return_early)
+                    break;
+            }
+            last_d = next_d;
+            last_slot = next_slot;
+        } else {
+            id = child;
+            last_d = -__FLT_MAX__;
+            last_slot = -1;
+        }
+    }
+    *iteration_count = k;
+    return hit_something;
+}
@@ -3,32 +3,171 @@
 
 #include "primitives.h"
 
+// Branching factor of the BVH, wider nodes are collapsed from the binary bvh::v2 tree
+#ifndef BVH_ARITY
 #define BVH_ARITY 2
+#endif
+
+#if BVH_ARITY == 2
+#define BVH_STACK_SIZE 32
+#elif BVH_ARITY == 4
+#define BVH_STACK_SIZE 48
+#elif BVH_ARITY == 8
+#define BVH_STACK_SIZE 80
+#else
+#error "BVH_ARITY must be 2, 4 or 8"
+#endif
+// The tree of an instanced mesh is traversed on the same stack as the top level tree, above a BVH_INSTANCE_EXIT entry
+#define BVH_INSTANCE_STACK_SIZE (2 * BVH_STACK_SIZE + 1)
 
 #define BVH_REORDER_TRIS
 
+// Every traversal gives up after this many steps, so that they all agree on where they stop and a broken tree can't
+// hang a kernel. Large enough for the stackless traversal, which also counts the steps back up the tree.
+#define BVH_MAX_ITERATIONS 1024
+
+// Child references: inner nodes are plain node indices, leaves have the top bit set and pack their primitive count,
+// their primitive type and first primitive in the remaining bits. Unused child slots hold BVH_EMPTY_CHILD.
+#define BVH_LEAF_BIT 0x80000000u
+#define BVH_LEAF_COUNT_SHIFT 27
+#define BVH_LEAF_MAX_COUNT 15u
+// Set on leaves whose primitives are spheres rather than triangles
+#define BVH_LEAF_SPHERES 0x04000000u
+#define BVH_LEAF_START_MASK 0x03FFFFFFu
+#define BVH_EMPTY_CHILD BVH_LEAF_BIT
+// Pushed on the traversal stack when entering an instance, popping it goes back to the top level tree in world space
+#define BVH_INSTANCE_EXIT BVH_EMPTY_CHILD
+
+// Parent references pack the index of the parent node and the slot of the child in it
+#define BVH_PARENT_SLOT_BITS 3
+#define BVH_NO_PARENT 0xFFFFFFFFu
+
+// With BVH_LEAF_BLOCKS, leaves start at a multiple of this many primitives so that each one covers whole
+// TriangleBlocks. One block fills a vector register: 8 lanes with AVX, 4 with SSE or NEON.
+#ifndef BVH_LEAF_BLOCK_SIZE
+#ifdef __AVX__
+#define BVH_LEAF_BLOCK_SIZE 8
+#else
+#define BVH_LEAF_BLOCK_SIZE 4
+#endif
+#endif
+
+// Child boxes are quantized to this many steps relative to the bounds of their parent
+#define BVH_QUANTIZATION_STEPS 255
+
+// The children of a node are sorted by their center along one axis, which is kept in the spare byte of child_min[0]
+#define BVH_ORDER_AXIS_SHIFT 24
+
+inline RA_FUNCTION bool bvh_is_leaf(uint32_t child) {
+    return (child & BVH_LEAF_BIT) != 0;
+}
+
+inline RA_FUNCTION uint32_t bvh_leaf_count(uint32_t child) {
+    return (child >> BVH_LEAF_COUNT_SHIFT) & BVH_LEAF_MAX_COUNT;
+}
+
+inline RA_FUNCTION uint32_t bvh_leaf_start(uint32_t child) {
+    return child & BVH_LEAF_START_MASK;
+}
+
+inline RA_FUNCTION bool bvh_leaf_is_spheres(uint32_t child) {
+    return (child & BVH_LEAF_SPHERES) != 0;
+}
+
+inline RA_FUNCTION uint32_t bvh_make_leaf(uint32_t start, uint32_t count) {
+    return BVH_LEAF_BIT | (count << BVH_LEAF_COUNT_SHIFT) | start;
+}
+
+inline RA_FUNCTION uint32_t bvh_make_sphere_leaf(uint32_t start, uint32_t count) {
+    return bvh_make_leaf(start, count) | BVH_LEAF_SPHERES;
+}
+
+enum BVHTraversal {
+    // Closest child first, with the postponed children kept in a fixed size private stack
+    BVH_TRAVERSAL_STACK,
+    // Constant per-ray state, walks back up using the parent references and re-tests the siblings
+    BVH_TRAVERSAL_STACKLESS,
+};
+
+// BVH_LEAF_BLOCK_SIZE consecutive leaf primitives in SoA layout, so the host can test one ray against all of them at
+// once. Padding primitives are degenerate and have a prim_id of -1.
+struct TriangleBlock {
+    float v0[3][BVH_LEAF_BLOCK_SIZE];
+    float e1[3][BVH_LEAF_BLOCK_SIZE];
+    float e2[3][BVH_LEAF_BLOCK_SIZE];
+    int prim_id[BVH_LEAF_BLOCK_SIZE];
+};
+
+/// A placement of a mesh in the scene. The triangles of the mesh are stored once in object space with their own
+/// subtree in the BVH, rays are moved into object space to traverse it.
+struct Instance {
+    // Columns of the affine object to world transform, the last one is the translation
+    vec3 to_world[4];
+    // Same for the inverse transform
+    vec3 to_object[4];
+    int mesh;
+    // Root of the subtree of the mesh, set by the BVH builder
+    uint32_t root;
+
+    // Keeps the direction unnormalized, so that distances along the ray are the same in both spaces
+    RA_METHOD Ray to_object_ray(Ray ray) const;
+    RA_METHOD Triangle to_world_triangle(Triangle tri) const;
+};
+
 struct BVH {
+    /// Inner node holding the boxes of all its children, so a traversal step only fetches the node itself.
+    /// Each child box is stored as 8 bits per plane, packed as x | y << 8 | z << 16, and decodes to origin + q * scale.
     struct Node {
-        bool is_leaf;
-        BBox box;
-        union {
-            struct {
-                size_t count;
-                int start;
-            } leaf;
-            struct {
-                int children[BVH_ARITY];
-            } inner;
-        };
+        vec3 origin;
+        vec3 scale;
+        uint32_t child_min[BVH_ARITY];
+        uint32_t child_max[BVH_ARITY];
+        uint32_t children[BVH_ARITY];
+
+        RA_METHOD BBox get_child_box(int i) const;
+        RA_METHOD int get_order_axis() const { return child_min[0] >> BVH_ORDER_AXIS_SHIFT; }
     };
-    int root = 0;
+    uint32_t root = 0;
     Node* nodes;
+    // One per node, see BVH_PARENT_SLOT_BITS
+    uint32_t* parents;
 #ifndef BVH_REORDER_TRIS
     int* indices;
 #endif
-    Triangle* tris;
+    TriangleIsect* tris;
+    // Leaves flagged with BVH_LEAF_SPHERES index this array directly, the model keeps its spheres in leaf order
+    Sphere* spheres = nullptr;
+    // If set, the tree starting at `root` is a top level tree over instances, its leaves point into this array one
+    // instance at a time. The subtrees of the meshes are in the same node and primitive arrays.
+    Instance* instances = nullptr;
+    // Host only, the same primitives as `tris` in leaf order, only used when BVH_LEAF_BLOCKS is defined
+    TriangleBlock* blocks = nullptr;
+    BVHTraversal traversal = BVH_TRAVERSAL_STACK;
 
-    RA_METHOD bool intersect(Ray ray, Hit& hit, bool return_early, int* iteration_count);
+    RA_METHOD bool intersect_stack(Ray ray, Hit& hit, bool return_early, int* iteration_count);
+    RA_METHOD bool intersect_stackless(Ray ray, Hit& hit, bool return_early, int* iteration_count);
+    // Tests the primitives of a leaf and shrinks ray.tmax to the closest hit, stops at the first hit with return_early.
+    // Leaves of the top level tree are entered by the traversals themselves, in the same loop.
+    RA_METHOD bool intersect_leaf(uint32_t leaf, Ray& ray, Hit& hit, bool return_early);
+    RA_METHOD bool occluded_leaf(uint32_t leaf, Ray ray);
+#ifdef BVH_LEAF_BLOCKS
+    // Same as above, testing BVH_LEAF_BLOCK_SIZE primitives at a time from `blocks`
+    RA_METHOD bool intersect_leaf_blocks(uint32_t start, uint32_t count, Ray& ray, Hit& hit, bool return_early);
+    RA_METHOD bool occluded_leaf_blocks(uint32_t start, uint32_t count, Ray ray);
+#endif
+    // Shading data of a hit primitive, in world space
+    RA_METHOD Triangle get_triangle(const Geometry& geometry, int prim_id, int inst_id) const;
+    RA_METHOD SurfacePoint get_surface(const Geometry& geometry, const Ray& ray, const Hit& hit) const;
+    // Only the material of get_surface, for binning hits before shading them
+    RA_METHOD int get_material(const Geometry& geometry, const Hit& hit) const;
+    // Any-hit traversal for shadow and AO rays: no hit record, no sorting by distance and stops at the first hit
+    RA_METHOD bool occluded(Ray ray);
+
+    RA_METHOD bool intersect(Ray ray, Hit& hit, bool return_early, int* iteration_count) {
+        if (traversal == BVH_TRAVERSAL_STACKLESS)
+            return intersect_stackless(ray, hit, return_early, iteration_count);
+        return intersect_stack(ray, hit, return_early, iteration_count);
+    }
     RA_METHOD bool intersect(Ray ray, Hit& hit, int* iteration_count) {
         return intersect(ray, hit, false, iteration_count);
     }
@@ -37,8 +176,11 @@ struct BVH {
         return intersect(ray, hit, return_early, &ic);
     }
     RA_METHOD bool intersect_shadow(Ray ray) { 
-        Hit hit;
-        return intersect(ray, hit, true);
+        if (traversal == BVH_TRAVERSAL_STACKLESS) {
+            Hit hit;
+            return intersect(ray, hit, true);
+        }
+        return occluded(ray);
     }
 };
 
@@ -7,6 +7,19 @@ struct Emitter {
     /// @brief Emission value with pdf already applied
     vec3 emission;
     int prim_id;
+    // Instance of the mesh the triangle belongs to, or -1 if the triangle is in world space
+    int inst_id = -1;
+
+    // Set by Model::build_emitter_table, for next event estimation
+    // World space face normal of the triangle
+    vec3 normal;
+    // Density per unit of area with which a point on this emitter gets sampled. Emitters are picked in proportion to
+    // their power, so this is the luminance of the emission over the total power of the emitters.
+    float pdf = 0;
+    // Walker alias table over the emitters after the environment: the slot of this emitter picks it with this
+    // probability, and `alias` otherwise
+    float alias_probability = 1;
+    int alias = 0;
 };
 
 #endif
\ No newline at end of file
@@ -14,5 +14,7 @@ struct Material {
     
     float transmission;
     vec3 emission;
+    // Emitter::pdf of the triangles of this material, for the MIS weight of emissive hits
+    float emitter_pdf = 0;
 };
 #endif
\ No newline at end of file
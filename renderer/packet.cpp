@@ -0,0 +1,317 @@
+#include "packet.h"
+#include "renderer.h"
+
+// GCC/Clang vector extensions, these map to SSE, AVX or AVX-512 depending on the target flags
+typedef float vfloat __attribute__((vector_size(RA_PACKET_SIZE * sizeof(float))));
+typedef int vint __attribute__((vector_size(RA_PACKET_SIZE * sizeof(int))));
+
+static inline vfloat splat(float f) {
+    return vfloat {} + f;
+}
+
+static inline vint splat(int i) {
+    return vint {} + i;
+}
+
+static inline vfloat select(vint mask, vfloat a, vfloat b) {
+    return (vfloat) (((vint) a & mask) | ((vint) b & ~mask));
+}
+
+static inline vint select(vint mask, vint a, vint b) {
+    return (a & mask) | (b & ~mask);
+}
+
+// Same NaN behaviour as fminf/fmaxf, so that packets cull exactly like single rays do
+static inline vfloat vmin(vfloat a, vfloat b) {
+    return select((a < b) | (b != b), a, b);
+}
+
+static inline vfloat vmax(vfloat a, vfloat b) {
+    return select((a > b) | (b != b), a, b);
+}
+
+// Lane by lane fmaf, so that boxes round exactly like BBox::intersect_range. With FMA in the target flags this is a
+// single vector instruction.
+static inline vfloat vfma(vfloat a, vfloat b, vfloat c) {
+    vfloat r;
+    for (int i = 0; i < RA_PACKET_SIZE; i++)
+        r[i] = fmaf(a[i], b[i], c[i]);
+    return r;
+}
+
+static inline unsigned to_bits(vint mask) {
+    unsigned bits = 0;
+    for (int i = 0; i < RA_PACKET_SIZE; i++)
+        bits |= (mask[i] != 0 ? 1u : 0u) << i;
+    return bits;
+}
+
+static inline vint from_bits(unsigned bits) {
+    vint mask;
+    for (int i = 0; i < RA_PACKET_SIZE; i++)
+        mask[i] = (bits >> i) & 1 ? -1 : 0;
+    return mask;
+}
+
+struct RayPacket {
+    vfloat org[3], dir[3];
+    vfloat inv_dir[3], morigin_t_riv[3];
+    vfloat tmin, tmax;
+};
+
+struct PacketHits {
+    vfloat u, v;
+    vint prim_id;
+    vint inst_id;
+};
+
+// Vectorized version of BBox::intersect_range followed by the hit test in BVH::intersect_stack
+static inline vint intersect_box(const RayPacket& p, const BBox& box, vfloat& t_entry) {
+    vfloat t0 = splat(-__FLT_MAX__), t1 = splat(__FLT_MAX__);
+    for (int axis = 0; axis < 3; axis++) {
+        vfloat tmin = vfma(splat(box.min.arr[axis]), p.inv_dir[axis], p.morigin_t_riv[axis]);
+        vfloat tmax = vfma(splat(box.max.arr[axis]), p.inv_dir[axis], p.morigin_t_riv[axis]);
+        vfloat lo = vmin(tmin, tmax);
+        vfloat hi = vmax(tmin, tmax);
+        t0 = axis == 0 ? lo : vmax(t0, lo);
+        t1 = axis == 0 ? hi : vmin(t1, hi);
+    }
+    t_entry = t0;
+    return (t0 <= t1) & (t1 > 0) & (t0 < p.tmax);
+}
+
+// Vectorized version of TriangleIsect::intersect, one triangle against all the rays of the packet
+static inline vint intersect_triangle(const RayPacket& p, const TriangleIsect& tri, vfloat& t, vfloat& u, vfloat& v) {
+    vfloat e1x = splat(tri.e1.x), e1y = splat(tri.e1.y), e1z = splat(tri.e1.z);
+    vfloat e2x = splat(tri.e2.x), e2y = splat(tri.e2.y), e2z = splat(tri.e2.z);
+
+    vfloat px = p.dir[1] * e2z - p.dir[2] * e2y;
+    vfloat py = p.dir[2] * e2x - p.dir[0] * e2z;
+    vfloat pz = p.dir[0] * e2y - p.dir[1] * e2x;
+    vfloat det = e1x * px + e1y * py + e1z * pz;
+    vint valid = ~((det > -1e-8f) & (det < 1e-8f));
+    vfloat inv_det = splat(1.0f) / det;
+
+    vfloat tx = p.org[0] - tri.v0.x;
+    vfloat ty = p.org[1] - tri.v0.y;
+    vfloat tz = p.org[2] - tri.v0.z;
+    u = (tx * px + ty * py + tz * pz) * inv_det;
+    valid &= ~((u < 0) | (u > 1));
+
+    vfloat qx = ty * e1z - tz * e1y;
+    vfloat qy = tz * e1x - tx * e1z;
+    vfloat qz = tx * e1y - ty * e1x;
+    v = (p.dir[0] * qx + p.dir[1] * qy + p.dir[2] * qz) * inv_det;
+    valid &= ~((v < 0) | (u + v > 1));
+
+    t = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+    valid &= ~(t < epsilon);
+    valid &= ~((t < p.tmin) | (t > p.tmax));
+    return valid;
+}
+
+void intersect_packet(const BVH& bvh, const Ray* rays, unsigned active, Hit* hits, bool* found, int* iteration_counts) {
+    RayPacket p;
+    PacketHits h;
+    h.prim_id = splat(-1);
+    h.inst_id = splat(-1);
+    for (int lane = 0; lane < RA_PACKET_SIZE; lane++) {
+        // Inactive lanes get a ray that can't hit anything
+        Ray r = (active >> lane) & 1 ? rays[lane] : Ray { vec3(0.0f), vec3(1.0f), 0, -1 };
+        for (int axis = 0; axis < 3; axis++) {
+            float inv_dir = 1.0f / r.dir.arr[axis];
+            p.org[axis][lane] = r.origin.arr[axis];
+            p.dir[axis][lane] = r.dir.arr[axis];
+            p.inv_dir[axis][lane] = inv_dir;
+            p.morigin_t_riv[axis][lane] = -r.origin.arr[axis] * inv_dir;
+        }
+        p.tmin[lane] = r.tmin;
+        p.tmax[lane] = r.tmax;
+        h.u[lane] = h.v[lane] = 0;
+        iteration_counts[lane] = 0;
+    }
+
+    struct Entry {
+        uint32_t ref;
+        unsigned mask;
+    };
+    Entry stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+
+    // Traverses the subtree of an entry one ray at a time
+    auto finish_per_ray = [&](Entry entry) {
+        BVH subtree = bvh;
+        subtree.root = entry.ref;
+        for (int lane = 0; lane < RA_PACKET_SIZE; lane++) {
+            if (!((entry.mask >> lane) & 1))
+                continue;
+            Ray r = rays[lane];
+            r.tmax = p.tmax[lane];
+            Hit lane_hit { .t = r.tmax, .prim_id = -1 };
+            int iterations;
+            if (subtree.intersect_stack(r, lane_hit, false, &iterations)) {
+                p.tmax[lane] = lane_hit.t;
+                h.u[lane] = lane_hit.primary.x;
+                h.v[lane] = lane_hit.primary.y;
+                h.prim_id[lane] = lane_hit.prim_id;
+                h.inst_id[lane] = lane_hit.inst_id;
+            }
+            iteration_counts[lane] += iterations + 1;
+        }
+    };
+
+    Entry e = { bvh.root, active };
+    for (int k = 0; k < BVH_MAX_ITERATIONS; k++) {
+        if (__builtin_popcount(e.mask) < RA_PACKET_MIN_ACTIVE) {
+            // The rays diverged, finish this subtree one ray at a time
+            finish_per_ray(e);
+        } else if (bvh_is_leaf(e.ref) && (bvh.instances || bvh_leaf_is_spheres(e.ref))) {
+            // Each ray enters the instance in its own object space, so the subtree of the mesh is traversed per ray.
+            // Spheres are rare enough not to get a vectorized test of their own.
+            finish_per_ray(e);
+        } else if (bvh_is_leaf(e.ref)) {
+            for (int lane = 0; lane < RA_PACKET_SIZE; lane++)
+                iteration_counts[lane] += (e.mask >> lane) & 1;
+
+            vint mask = from_bits(e.mask);
+            uint32_t start = bvh_leaf_start(e.ref);
+            uint32_t count = bvh_leaf_count(e.ref);
+            for (uint32_t i = 0; i < count; i++) {
+#ifndef BVH_REORDER_TRIS
+                const TriangleIsect& tri = bvh.tris[bvh.indices[start + i]];
+#else
+                const TriangleIsect& tri = bvh.tris[start + i];
+#endif
+                vfloat t, u, v;
+                vint hit = intersect_triangle(p, tri, t, u, v) & mask;
+                if (!to_bits(hit))
+                    continue;
+                p.tmax = select(hit, t, p.tmax);
+                h.u = select(hit, u, h.u);
+                h.v = select(hit, v, h.v);
+                h.prim_id = select(hit, splat(tri.prim_id), h.prim_id);
+            }
+        } else {
+            for (int lane = 0; lane < RA_PACKET_SIZE; lane++)
+                iteration_counts[lane] += (e.mask >> lane) & 1;
+
+            BVH::Node n = bvh.nodes[e.ref];
+
+            // Same ordering as the single ray traversal, using the closest entry distance among the active rays
+            Entry hit_children[BVH_ARITY];
+            float hit_distances[BVH_ARITY];
+            int hit_count = 0;
+            for (int i = 0; i < BVH_ARITY; i++) {
+                if (n.children[i] == BVH_EMPTY_CHILD)
+                    continue;
+                vfloat t_entry;
+                unsigned mask = to_bits(intersect_box(p, n.get_child_box(i), t_entry)) & e.mask;
+                if (!mask)
+                    continue;
+                float child_d = __FLT_MAX__;
+                for (int lane = 0; lane < RA_PACKET_SIZE; lane++) {
+                    if ((mask >> lane) & 1)
+                        child_d = fminf(child_d, t_entry[lane]);
+                }
+                int j = hit_count++;
+                for (; j > 0 && hit_distances[j - 1] <= child_d; j--) {
+                    hit_distances[j] = hit_distances[j - 1];
+                    hit_children[j] = hit_children[j - 1];
+                }
+                hit_distances[j] = child_d;
+                hit_children[j] = Entry { n.children[i], mask };
+            }
+
+            if (hit_count > 0) {
+                for (int i = 0; i < hit_count - 1; i++) {
+                    // A full stack can't postpone the child, it is traversed right away instead
+                    if (stack_size < BVH_STACK_SIZE)
+                        stack[stack_size++] = hit_children[i];
+                    else
+                        finish_per_ray(hit_children[i]);
+                }
+                e = hit_children[hit_count - 1];
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            break;
+        e = stack[--stack_size];
+    }
+
+    for (int lane = 0; lane < RA_PACKET_SIZE; lane++) {
+        if (!((active >> lane) & 1))
+            continue;
+        // Counted like BVH::intersect_stack, which doesn't count the last visited node
+        iteration_counts[lane]--;
+        found[lane] = h.prim_id[lane] >= 0;
+        if (found[lane])
+            hits[lane] = Hit { .t = p.tmax[lane], .primary = vec2(h.u[lane], h.v[lane]), .prim_id = h.prim_id[lane], .inst_id = h.inst_id[lane] };
+    }
+}
+
+extern "C" {
+
+thread_local extern vec2 gl_GlobalInvocationID;
+
+RA_PACKET_RENDERER_SIGNATURE {
+    int x0 = gl_GlobalInvocationID.x;
+    int y0 = gl_GlobalInvocationID.y;
+
+    // Pixels of the packet that take samples: the ones in the frame that haven't converged yet
+    bool adaptive_sampling = adaptive_sampling_enabled(adaptive, mode);
+    unsigned pixels = 0;
+    for (int lane = 0; lane < RA_PACKET_SIZE; lane++) {
+        int x = x0 + lane % RA_PACKET_WIDTH;
+        int y = y0 + lane / RA_PACKET_WIDTH;
+        if (x >= width || y >= height)
+            continue;
+        if (adaptive_sampling && accum > 0 && pixel_converged(x, y, RA_RENDERER_ARGS))
+            continue;
+        pixels |= 1u << lane;
+    }
+    if (!pixels)
+        return;
+
+    vec3 sums[RA_PACKET_SIZE];
+    float sums_lum2[RA_PACKET_SIZE];
+    int samples = mode_accumulates(mode) ? spp : 1;
+    for (int sample = 0; sample < samples; sample++) {
+        Ray rays[RA_PACKET_SIZE];
+        RNGState rngs[RA_PACKET_SIZE];
+        Hit hits[RA_PACKET_SIZE];
+        for (int lane = 0; lane < RA_PACKET_SIZE; lane++) {
+            if (!((pixels >> lane) & 1))
+                continue;
+            int x = x0 + lane % RA_PACKET_WIDTH;
+            int y = y0 + lane / RA_PACKET_WIDTH;
+            rngs[lane] = seed_pixel_rng(accum + sample, x, y);
+            rays[lane] = generate_primary_ray(cam, x, y, width, height, &rngs[lane]);
+            hits[lane] = Hit { .t = rays[lane].tmax, .prim_id = -1 };
+        }
+
+        bool found[RA_PACKET_SIZE];
+        int iterations[RA_PACKET_SIZE];
+        intersect_packet(bvh, rays, pixels, hits, found, iterations);
+
+        for (int lane = 0; lane < RA_PACKET_SIZE; lane++) {
+            if (!((pixels >> lane) & 1))
+                continue;
+            int x = x0 + lane % RA_PACKET_WIDTH;
+            int y = y0 + lane / RA_PACKET_WIDTH;
+            vec3 color = shade_primary_hit(x, y, rays[lane], found[lane], hits[lane], iterations[lane], &rngs[lane], RA_RENDERER_ARGS);
+            float lum2 = color_luminance(color) * color_luminance(color);
+            sums[lane] = sample == 0 ? color : sums[lane] + color;
+            sums_lum2[lane] = sample == 0 ? lum2 : sums_lum2[lane] + lum2;
+        }
+    }
+
+    for (int lane = 0; lane < RA_PACKET_SIZE; lane++) {
+        int x = x0 + lane % RA_PACKET_WIDTH;
+        int y = y0 + lane / RA_PACKET_WIDTH;
+        if ((pixels >> lane) & 1)
+            write_pixel_samples(x, y, sums[lane], sums_lum2[lane], RA_RENDERER_ARGS);
+    }
+}
+
+}
@@ -0,0 +1,18 @@
+#ifndef RA_PACKET_H_
+#define RA_PACKET_H_
+
+#include "bvh.h"
+
+// CPU only: coherent rays are traced together, one SIMD lane per ray
+
+#define RA_PACKET_WIDTH 4
+#define RA_PACKET_HEIGHT 2
+#define RA_PACKET_SIZE (RA_PACKET_WIDTH * RA_PACKET_HEIGHT)
+
+// Below this many active rays, a subtree is finished with the single ray traversal instead
+#define RA_PACKET_MIN_ACTIVE 2
+
+/// Finds the closest hit of every ray whose bit is set in `active`. The other lanes are left untouched.
+void intersect_packet(const BVH& bvh, const Ray* rays, unsigned active, Hit* hits, bool* found, int* iteration_counts);
+
+#endif
@@ -1,24 +1,59 @@
 #include "primitives.h"
 
-RA_METHOD bool Sphere::intersect(Ray r, Hit& hit) {
-    vec3 rs = r.origin - this->center;
-    float b = dot(rs, r.dir);
-    float c = dot(rs, rs) - this->radius * this->radius;
-    float d = b * b - c;
-
-    if (d > 0.0f) {
-        float t = -b - sqrtf(d);
-        if (t > r.tmin && t < r.tmax) {
-            hit.t = t;
-            hit.primary = vec2(r.dir.x, r.dir.y); // TODO
-            hit.prim_id = prim_id;
-            // vec3 p = r.origin + r.dir * t;
-            // hit.n = normalize(p - this->center);
-            return true;
-        }
+RA_FUNCTION vec2 octahedral_encode(vec3 n) {
+    float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+    if (l1 <= 0.0f)
+        return vec2(0.0f);
+    vec2 p = vec2(n.x / l1, n.y / l1);
+    if (n.z < 0.0f) {
+        // The lower hemisphere is folded over the diagonals
+        p = vec2((1.0f - fabs(p.y)) * (p.x >= 0.0f ? 1.0f : -1.0f),
+                 (1.0f - fabs(p.x)) * (p.y >= 0.0f ? 1.0f : -1.0f));
     }
+    return p;
+}
 
-    return false;
+RA_FUNCTION vec3 octahedral_decode(vec2 p) {
+    vec3 n = vec3(p.x, p.y, 1.0f - fabs(p.x) - fabs(p.y));
+    float t = fmaxf(-n.z, 0.0f);
+    n.x = n.x + (n.x >= 0.0f ? -t : t);
+    n.y = n.y + (n.y >= 0.0f ? -t : t);
+    return normalize(n);
+}
+
+// Nearest of the two intersections within the ray, or a negative value. The direction doesn't need to be normalized.
+RA_FUNCTION static float intersect_sphere(vec3 center, float radius, Ray r) {
+    vec3 rs = r.origin - center;
+    float a = r.dir.dot(r.dir);
+    float b = rs.dot(r.dir);
+    float c = rs.dot(rs) - radius * radius;
+    float d = b * b - a * c;
+    if (d < 0.0f)
+        return -1.0f;
+
+    float tmin = fmaxf(r.tmin, epsilon);
+    float sqrt_d = sqrtf(d);
+    float t = (-b - sqrt_d) / a;
+    if (t < tmin)
+        t = (-b + sqrt_d) / a; // The ray starts inside the sphere
+    return t >= tmin && t <= r.tmax ? t : -1.0f;
+}
+
+RA_METHOD bool Sphere::intersect(Ray r, Hit& hit) {
+    float t = intersect_sphere(center, radius, r);
+    if (t < 0.0f)
+        return false;
+    hit.t = t;
+    hit.primary = octahedral_encode(r.origin + r.dir * t - center);
+    return true;
+}
+
+RA_METHOD bool Sphere::occludes(Ray r) {
+    return intersect_sphere(center, radius, r) >= 0.0f;
+}
+
+RA_METHOD vec3 Sphere::get_normal(vec2 primary) const {
+    return octahedral_decode(primary);
 }
 
 RA_METHOD void BBox::intersect_range(Ray r, vec3 ray_inv_dir, vec3 morigin_t_riv, float t[2]) {
@@ -99,65 +134,98 @@ RA_METHOD bool BBox::contains(vec3 point) {
         && point.z >= min.z && point.z <= max.z;
 }
 
-RA_METHOD bool Triangle::intersect(Ray ray, Hit& hit) {
-    const auto &v0       = this->v0;
-    const auto &v1       = this->v1;
-    const auto &v2       = this->v2;
+RA_FUNCTION static float decode_snorm16(uint32_t bits) {
+    int i = (int) (bits & 0xFFFF);
+    if (i >= 0x8000)
+        i -= 0x10000;
+    return fmaxf(i / 32767.0f, -1.0f);
+}
+
+// Done with arithmetic rather than bit casts, which vcc doesn't have. Infinities and NaNs are never encoded.
+RA_FUNCTION static float decode_half(uint32_t bits) {
+    float sign = (bits & 0x8000) ? -1.0f : 1.0f;
+    int exponent = (bits >> 10) & 0x1F;
+    float mantissa = (float) (bits & 0x3FF);
+    if (exponent == 0)
+        return sign * mantissa * 5.9604645e-8f; // 2^-24
+    return sign * (1.0f + mantissa / 1024.0f) * exp2f((float) (exponent - 15));
+}
+
+RA_METHOD vec3 VertexAttributes::get_normal() const {
+    return octahedral_decode(vec2(decode_snorm16(normal), decode_snorm16(normal >> 16)));
+}
+
+RA_METHOD vec2 VertexAttributes::get_texcoords() const {
+    return vec2(decode_half(texcoords), decode_half(texcoords >> 16));
+}
+
+RA_METHOD Triangle Geometry::get_triangle(int prim_id) const {
+    IndexedTriangle indexed = triangles[prim_id];
+    VertexAttributes a0 = attributes[indexed.vertices[0]];
+    VertexAttributes a1 = attributes[indexed.vertices[1]];
+    VertexAttributes a2 = attributes[indexed.vertices[2]];
+    return Triangle {
+        .prim_id = prim_id,
+        .mat_id = indexed.mat_id,
+        .v0 = positions[indexed.vertices[0]],
+        .v1 = positions[indexed.vertices[1]],
+        .v2 = positions[indexed.vertices[2]],
+        .n0 = a0.get_normal(),
+        .n1 = a1.get_normal(),
+        .n2 = a2.get_normal(),
+        .t0 = a0.get_texcoords(),
+        .t1 = a1.get_texcoords(),
+        .t2 = a2.get_texcoords(),
+    };
+}
 
-    // why does 'auto' break it ?
-    const vec3 edge1 = v1 - v0;
-    const vec3 edge2 = v2 - v0;
+RA_METHOD bool Triangle::intersect(Ray ray, Hit& hit) {
+    TriangleIsect isect {
+        .v0 = v0,
+        .e1 = v1 - v0,
+        .e2 = v2 - v0,
+        .prim_id = prim_id,
+    };
+    return isect.intersect(ray, hit);
+}
 
-    const auto pvec = ray.dir.cross(edge2);
-    const auto det  = edge1.dot(pvec);
+// Möller-Trumbore, the one ray-triangle test that all the others go through. Returns whether the ray hits the triangle
+// between its tmin and tmax, and the distance and barycentrics of the hit if it does.
+RA_FUNCTION static bool intersect_triangle(vec3 v0, vec3 e1, vec3 e2, Ray ray, float& t, float& u, float& v) {
+    const auto pvec = ray.dir.cross(e2);
+    const auto det  = e1.dot(pvec);
     if (det > -1e-8f && det < 1e-8f)
         return false;
     const auto invDet = 1 / det;
 
     const auto tvec = ray.origin - v0;
-    const float u   = tvec.dot(pvec) * invDet;
+    u = tvec.dot(pvec) * invDet;
     if (u < 0 || u > 1)
         return false;
 
-    const auto qvec = tvec.cross(edge1);
-    const float v   = ray.dir.dot(qvec) * invDet;
+    const auto qvec = tvec.cross(e1);
+    v = ray.dir.dot(qvec) * invDet;
     if (v < 0 || u + v > 1)
         return false;
 
-    const float t = edge2.dot(qvec) * invDet;
-    if (t < epsilon)
-        return false;
-
-    // const auto vInterpolated = Vertex::interpolate({ u, v }, v0, v1, v2);
-
-    //const auto deltaUV1 = v1.uv - v0.uv;
-    //const auto deltaUV2 = v2.uv - v0.uv;
-    //const float r =
-    //    deltaUV1.x() * deltaUV2.y() - deltaUV1.y() * deltaUV2.x();
-    //const auto tangent =
-    //    abs(r) < 1e-6 ? edge1
-    //                  : (edge1 * deltaUV2.y() - edge2 * deltaUV1.y()) / r;
+    t = e2.dot(qvec) * invDet;
+    return !(t < epsilon) && !(t < ray.tmin || t > ray.tmax);
+}
 
-    if (t < ray.tmin || t > ray.tmax)
+RA_METHOD bool TriangleIsect::intersect(Ray ray, Hit& hit) {
+    float t, u, v;
+    if (!intersect_triangle(v0, e1, e2, ray, t, u, v))
         return false;
 
     hit.t = t;
-    //hit.p = interpolateBarycentric<vec3>({u, v}, v0, v1, v2);
     hit.primary = vec2(u, v);
     hit.prim_id = prim_id;
-    // hit.u = u;
-    // hit.v = v;
-    // hit.n = normalize(edge1.cross(edge2));
     return true;
+}
 
-    //its.t              = t;
-    //its.position       = vInterpolated.position;
-    //its.uv             = vInterpolated.uv;
-    //its.geometryNormal = edge1.cross(edge2).normalized();
-    //its.shadingNormal  = m_smoothNormals ? vInterpolated.normal.normalized()
-    //                                     : its.geometryNormal;
-    //its.tangent        = tangent;
-    //its.pdf            = 0;
+RA_METHOD bool TriangleIsect::occludes(Ray ray) {
+    float t, u, v;
+    return intersect_triangle(v0, e1, e2, ray, t, u, v);
 }
 
 /// Ensure a stable triangle normal using all three edges instead of only two
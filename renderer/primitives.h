@@ -23,15 +23,40 @@ struct Hit {
     float t;
     vec2 primary; // aka. barycentric coordinates
     int prim_id;
+    int inst_id = -1; // Instance the primitive was hit through, -1 when the BVH has no instances
 };
 
+// Hits on spheres have this bit set in their prim_id, the remaining bits are the index of the sphere
+#define PRIM_SPHERE_BIT 0x40000000
+
+inline RA_FUNCTION bool prim_is_sphere(int prim_id) {
+    return (prim_id & PRIM_SPHERE_BIT) != 0;
+}
+
+// Octahedral mapping between unit vectors and [-1, 1]^2
+RA_FUNCTION vec2 octahedral_encode(vec3 n);
+RA_FUNCTION vec3 octahedral_decode(vec2 p);
+
+/// Procedural sphere, as used for particles. Its material and prim_id are kept by the model and the BVH.
 struct Sphere {
-    int prim_id;
-    int mat_id;
     vec3 center;
     float radius;
 
+    // Sets hit.t and hit.primary, which is the octahedral mapping of the normal at the hit
     RA_METHOD bool intersect(Ray r, Hit&);
+    RA_METHOD bool occludes(Ray r);
+    RA_METHOD vec3 get_normal(vec2 primary) const;
+};
+
+/// What shading needs to know about a hit, for any kind of primitive
+struct SurfacePoint {
+    vec3 position;
+    vec3 normal; // Interpolated shading normal
+    vec3 face_normal;
+    vec2 texcoords;
+    int mat_id;
+    // Area of the primitive as NEE samples it, 0 if NEE never picks it
+    float area;
 };
 
 struct BBox {
@@ -48,7 +73,6 @@ struct Triangle {
     vec3 v0, v1, v2; // 9
     vec3 n0, n1, n2; // 9
     vec2 t0, t1, t2; // 9 -> 29
-    float _pad[3];
 
     RA_METHOD bool intersect(Ray r, Hit&);
     RA_METHOD vec3 get_face_normal() const;
@@ -59,4 +83,41 @@ struct Triangle {
     RA_METHOD vec2 sample_point_on_surface(RNGState* rng);
 };
 
+/// Shading attributes of a vertex, kept apart from the positions which are all that building and refitting need
+struct VertexAttributes {
+    uint32_t normal;    // Octahedral mapping of the unit normal, as two 16 bit snorms
+    uint32_t texcoords; // Two half floats
+
+    RA_METHOD vec3 get_normal() const;
+    RA_METHOD vec2 get_texcoords() const;
+};
+
+/// A triangle of an indexed mesh, its prim_id is its index in `Geometry::triangles`
+struct IndexedTriangle {
+    int vertices[3];
+    int mat_id;
+};
+
+/// Indexed triangles sharing their vertices. Triangles are only expanded into a `Triangle` when they are shaded.
+/// Spheres are addressed by the index in the prim_id of their hits, see PRIM_SPHERE_BIT.
+struct Geometry {
+    const IndexedTriangle* triangles;
+    const vec3* positions;
+    const VertexAttributes* attributes;
+    const Sphere* spheres;
+    const int* sphere_materials;
+
+    RA_METHOD Triangle get_triangle(int prim_id) const;
+};
+
+/// Intersection-only part of a triangle, as referenced by the BVH leaves. The shading attributes stay in Triangle
+/// and are only fetched once the closest hit is known.
+struct TriangleIsect {
+    vec3 v0, e1, e2; // 9
+    int prim_id;     // 1 -> 10
+
+    RA_METHOD bool intersect(Ray r, Hit&);
+    RA_METHOD bool occludes(Ray r);
+};
+
 #endif
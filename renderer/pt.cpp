@@ -5,49 +5,40 @@
 #include "emitter.h"
 #include "bsdf.h"
 
-RA_FUNCTION inline int sample_emitter(RNGState* rng, int num_lights) {
-    return (int)randi_max(rng, num_lights);
+// Picks one of the `count` emitters after the environment map in proportion to its power, see Model::build_emitter_table
+RA_FUNCTION inline int sample_emitter(RNGState* rng, const Emitter* emitters, int count) {
+    int slot = (int)randi_max(rng, count - 1) + 1; // Skip environment map (id == 0)
+    return randf(rng) < emitters[slot].alias_probability ? slot : emitters[slot].alias;
 }
 
 RA_FUNCTION inline float compute_rr_factor(vec3 color, int depth) {
     return depth < 2 ? 1.0f : clampf(2 * color_luminance(color), 0.05f, 0.95f);
 }
 
-RA_FUNCTION vec3 pt_handle_nee(RNGState* rng, float prev_pdf, vec3 out_dir, vec3 pos_surface, vec2 uv_surface, const Material& mat, const shading::ShadingFrame& frame, const RenderContext& ctx) {
+RA_FUNCTION bool pt_sample_nee(RNGState* rng, vec3 out_dir, vec3 pos_surface, vec2 uv_surface, const Material& mat, const shading::ShadingFrame& frame, const RenderContext& ctx, ShadowRay* shadow) {
     const float offset = 0.001f;
 
-    int picked_light = sample_emitter(rng, ctx.num_lights-1) + 1; // Skip environment map (id == 0)
+    int picked_light = sample_emitter(rng, ctx.emitters, ctx.num_lights-1);
     Emitter emitter  = ctx.emitters[picked_light];
-    Triangle tri     = ctx.primitives[emitter.prim_id];
+    Triangle tri     = ctx.bvh->get_triangle(*ctx.geometry, emitter.prim_id, emitter.inst_id);
     vec2 bary        = tri.sample_point_on_surface(rng);
     vec3 pos_light   = tri.get_position(bary);
-    vec3 fn          = tri.get_face_normal();
-    float area       = tri.get_area();
+    vec3 fn          = emitter.normal;
 
     vec3 in_dir = (pos_light - pos_surface);    
     float dist2 = lengthSquared(in_dir);
     if (dist2 <= __FLT_EPSILON__)
-        return vec3(0);
+        return false;
 
     float dist = sqrtf(dist2);
     in_dir     = in_dir / dist;
 
-    Ray shadow_ray = { 
-        .origin = pos_surface,
-        .dir    = in_dir,
-        .tmin   = offset,
-        .tmax   = dist - offset,
-    };
-
-    if (ctx.bvh->intersect_shadow(shadow_ray))
-        return vec3(0);
-
     float dot     = fmaxf(fn.dot(-in_dir), 0);
     float geom    = dot <= __FLT_EPSILON__ ? 0 : dist2 / dot;
-    float pdf_nee = geom / ( area * (ctx.num_lights - 1));
+    float pdf_nee = geom * emitter.pdf;
 
     if (pdf_nee <= __FLT_EPSILON__)
-        return vec3(0);
+        return false;
 
     vec3 out_dir_s  = shading::to_local(out_dir, frame);
     vec3 in_dir_s   = shading::to_local(in_dir, frame);
@@ -55,69 +46,125 @@ RA_FUNCTION vec3 pt_handle_nee(RNGState* rng, float prev_pdf, vec3 out_dir, vec3
     vec3 bsdfFactor = shading::eval_material(in_dir_s, out_dir_s, uv_surface, mat, ctx.textures);                                                                                                                                                                                 
 
     float mis = 1 / (1 + pdf_bsdf / pdf_nee);
-    return mis * bsdfFactor * emitter.emission / pdf_nee;
+    shadow->ray = Ray {
+        .origin = pos_surface,
+        .dir    = in_dir,
+        .tmin   = offset,
+        .tmax   = dist - offset,
+    };
+    shadow->contrib = mis * bsdfFactor * emitter.emission / pdf_nee;
+    return true;
 }
 
 // Note: This is a basic pathtracer with NEE but only for area lights
 RA_FUNCTION vec3 pathtrace(RNGState* rng, Ray ray, int depth, vec3 throughput, float prev_pdf, const RenderContext& ctx) {
-    const float offset = 0.001f;
-
-    vec3 lo = 0.0f;
-
     if (depth > ctx.max_depth)
         return vec3(0);
     
     Hit hit { .t = ray.tmax };
-    if (ctx.bvh->intersect(ray, hit)) {
-        Triangle tri = ctx.primitives[hit.prim_id];
-        Material mat = ctx.materials[tri.mat_id];
+    bool found = ctx.bvh->intersect(ray, hit);
+    return pathtrace_hit(rng, ray, found, hit, depth, throughput, prev_pdf, ctx);
+}
+
+RA_FUNCTION vec3 pathtrace_hit(RNGState* rng, Ray ray, bool found, Hit hit, int depth, vec3 throughput, float prev_pdf, const RenderContext& ctx) {
+    PathState state {
+        .rng = *rng,
+        .ray = ray,
+        .throughput = throughput,
+        .prev_pdf = prev_pdf,
+        .depth = depth,
+    };
+    vec3 contrib = vec3(0);
+#ifdef RA_RECURSIVE_PT
+    bool bounced = pathtrace_step(state, found, hit, &contrib, ctx);
+    *rng = state.rng;
+    if (!bounced)
+        return contrib;
+    return contrib + pathtrace(rng, state.ray, state.depth, state.throughput, state.prev_pdf, ctx);
+#else
+    // Loops instead of recursing, which shady lowers to an emulated stack that grows with the max depth
+    while (pathtrace_step(state, found, hit, &contrib, ctx)) {
+        hit = Hit { .t = state.ray.tmax };
+        found = ctx.bvh->intersect(state.ray, hit);
+    }
+    *rng = state.rng;
+    return contrib;
+#endif
+}
+
+RA_FUNCTION bool pathtrace_step(PathState& state, bool found, Hit hit, vec3* contrib, const RenderContext& ctx) {
+    ShadowRay shadow;
+    bool connect = false;
+    bool bounced = pathtrace_shade(state, found, hit, contrib, &shadow, &connect, ctx);
+    if (connect && !ctx.bvh->intersect_shadow(shadow.ray))
+        *contrib = *contrib + shadow.contrib;
+    return bounced;
+}
 
-        vec3 contrib = vec3(0);
+RA_FUNCTION bool pathtrace_shade(PathState& state, bool found, Hit hit, vec3* contrib, ShadowRay* shadow, bool* connect, const RenderContext& ctx) {
+    const float offset = 0.001f;
+
+    RNGState* rng = &state.rng;
+    Ray ray = state.ray;
+    vec3 throughput = state.throughput;
+    int depth = state.depth;
+
+    if (depth > ctx.max_depth)
+        return false;
 
-        vec3 n     = tri.get_vertex_normal(hit.primary);
-        vec3 p     = tri.get_position(hit.primary);
-        vec2 uv    = tri.get_texcoords(hit.primary);
-        vec3 fn    = tri.get_face_normal();
+    if (found) {
+        SurfacePoint surface = ctx.bvh->get_surface(*ctx.geometry, ray, hit);
+        Material mat = ctx.materials[surface.mat_id];
+
+        vec3 n     = surface.normal;
+        vec3 p     = surface.position;
+        vec2 uv    = surface.texcoords;
+        vec3 fn    = surface.face_normal;
         auto frame = shading::make_shading_frame(n);
 
         // Handle NEE if enabled and there is enough room
-        if (ctx.enable_nee && depth + 1 <= ctx.max_depth)
-            contrib = contrib + throughput * pt_handle_nee(rng, prev_pdf, -ray.dir, p, uv, mat, frame, ctx);
+        if (ctx.enable_nee && depth + 1 <= ctx.max_depth && pt_sample_nee(rng, -ray.dir, p, uv, mat, frame, ctx, shadow)) {
+            shadow->contrib = throughput * shadow->contrib;
+            *connect = true;
+        }
 
         // Handle emissive hits only when hit from the front
         float fn_dot = fmaxf(fn.dot(-ray.dir), 0);
         if (fn_dot > __FLT_EPSILON__) {
             vec3 emission = throughput * mat.emission;
             float mis = 1;
-            if (ctx.enable_nee && depth > 0) {
-                float area = tri.get_area();
+            // NEE never samples primitives without an area, such as spheres
+            if (ctx.enable_nee && depth > 0 && surface.area > 0) {
                 float dist2 = lengthSquared(p - ray.origin);
                 float geom = dist2 / fn_dot;
-                float pdf_nee = geom / ( area * (ctx.num_lights - 1));
-                mis = 1 / (1 + pdf_nee / prev_pdf);
+                float pdf_nee = geom * mat.emitter_pdf;
+                mis = 1 / (1 + pdf_nee / state.prev_pdf);
             }
-            contrib = contrib + emission * mis;
+            *contrib = *contrib + emission * mis;
         }
 
         // Next bounce
         const auto sample = shading::sample_material(rng, shading::to_local(-ray.dir, frame), uv, mat, ctx.textures);
         if (sample.pdf <= __FLT_EPSILON__)
-            return contrib;
+            return false;
 
         // - Handle rr
         float rr = compute_rr_factor(sample.color * throughput, depth);
         if (randf(rng) > rr)
-            return contrib;
+            return false;
 
-        Ray bounced_ray = { 
+        state.ray = Ray {
             .origin = p,
             .dir  = shading::to_world(sample.dir, frame),
             .tmin = offset,
             .tmax = __FLT_MAX__,
         };
-
-        return contrib + pathtrace(rng, bounced_ray, depth + 1, throughput * sample.color / rr, sample.pdf, ctx);
+        state.throughput = throughput * sample.color / rr;
+        state.prev_pdf = sample.pdf;
+        state.depth = depth + 1;
+        return state.depth <= ctx.max_depth;
     } else {
-        return throughput * ctx.emitters[0].emission;
+        *contrib = *contrib + throughput * ctx.emitters[0].emission;
+        return false;
     }
-}
\ No newline at end of file
+}
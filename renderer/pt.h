@@ -5,6 +5,28 @@
 #include "random.h"
 #include "rendercontext.h"
 
+// Everything needed to continue a path from one bounce to the next
+struct PathState {
+    RNGState rng;
+    Ray ray;
+    vec3 throughput;
+    float prev_pdf;
+    int depth;
+};
+
+// A connection from a surface to a point sampled on an emitter, which adds `contrib` to the path unless `ray` is blocked
+struct ShadowRay {
+    Ray ray;
+    vec3 contrib;
+};
+
 RA_FUNCTION vec3 pathtrace(RNGState* rng, Ray ray, int depth, vec3 throughput, float prev_pdf, const RenderContext& ctx);
+// Same as pathtrace, for when the closest hit along `ray` is already known
+RA_FUNCTION vec3 pathtrace_hit(RNGState* rng, Ray ray, bool found, Hit hit, int depth, vec3 throughput, float prev_pdf, const RenderContext& ctx);
+// Shades the closest hit along `state.ray` and adds its contribution to `contrib`.
+// Returns true if the path goes on, in which case `state` holds the next ray to trace.
+RA_FUNCTION bool pathtrace_step(PathState& state, bool found, Hit hit, vec3* contrib, const RenderContext& ctx);
+// Same as pathtrace_step, but leaves the shadow ray of NEE to the caller: `connect` is set if `shadow` needs to be traced.
+RA_FUNCTION bool pathtrace_shade(PathState& state, bool found, Hit hit, vec3* contrib, ShadowRay* shadow, bool* connect, const RenderContext& ctx);
 
 #endif
\ No newline at end of file
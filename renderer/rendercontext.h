@@ -4,13 +4,13 @@
 #include "ra_math.h"
 #include "texture.h"
 
-struct Triangle;
+struct Geometry;
 struct Material;
 struct Emitter;
 struct BVH;
 
 struct RenderContext {
-    const Triangle* primitives;
+    const Geometry* geometry;
     const Material* materials;
     int num_lights;
     const Emitter* emitters;
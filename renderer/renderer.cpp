@@ -28,157 +28,110 @@ RA_FUNCTION uint32_t& access_frame_buffer(uint32_t* buffer, int x, int y, int wi
     return buffer[((height - 1 - y) * width + x)];
 }
 
-RA_FUNCTION vec3 read_film(float* film, int x, int y, int width, int height) {
+RA_FUNCTION float& access_film_plane(float* film, int plane, int x, int y, int width, int height) {
     size_t film_size_per_component = (width * height);
-    float fx = film[((height - 1 - y) * width + x) + film_size_per_component * 0];
-    float fy = film[((height - 1 - y) * width + x) + film_size_per_component * 1];
-    float fz = film[((height - 1 - y) * width + x) + film_size_per_component * 2];
+    return film[((height - 1 - y) * width + x) + film_size_per_component * plane];
+}
+
+RA_FUNCTION vec3 read_film(float* film, int x, int y, int width, int height) {
+    float fx = access_film_plane(film, 0, x, y, width, height);
+    float fy = access_film_plane(film, 1, x, y, width, height);
+    float fz = access_film_plane(film, 2, x, y, width, height);
     return vec3(fx, fy, fz);
 }
 
 RA_FUNCTION void write_film(float* film, int x, int y, int width, int height, vec3 value) {
-    size_t film_size_per_component = (width * height);
-    film[((height - 1 - y) * width + x) + film_size_per_component * 0] = value.x;
-    film[((height - 1 - y) * width + x) + film_size_per_component * 1] = value.y;
-    film[((height - 1 - y) * width + x) + film_size_per_component * 2] = value.z;
+    access_film_plane(film, 0, x, y, width, height) = value.x;
+    access_film_plane(film, 1, x, y, width, height) = value.y;
+    access_film_plane(film, 2, x, y, width, height) = value.z;
 }
 
-extern "C" {
+RA_FUNCTION void accumulate_film(float* film, uint32_t* fb, int x, int y, int width, int height, unsigned accum, vec3 color, int samples) {
+    vec3 film_data = vec3(0);
+    if (accum > 0) {
+        film_data = read_film(film, x, y, width, height);
+    }
+    film_data = film_data + color;
+    write_film(film, x, y, width, height, film_data);
+    access_frame_buffer(fb, x, y, width, height) = pack_color(1.0f * film_data / (accum + samples));
+}
 
-#ifdef __SHADY__
-#include "shady.h"
-using namespace vcc;
-#elif __CUDACC__
-#define gl_GlobalInvocationID (uint3(threadIdx.x + blockDim.x * blockIdx.x, threadIdx.y + blockDim.y * blockIdx.y, threadIdx.z + blockDim.z * blockIdx.z))
-#else
-thread_local extern vec2 gl_GlobalInvocationID;
-#endif
+// `n` samples with the given sums have a mean luminance whose standard error is under the target, relative to the mean
+RA_FUNCTION bool samples_converged(vec3 sum, float sum_lum2, float n, const AdaptiveSampling& adaptive) {
+    if (n < adaptive.min_samples)
+        return false;
+    float mean = color_luminance(sum) / n;
+    float variance = fmaxf(sum_lum2 / n - mean * mean, 0.0f);
+    return sqrtf(variance / n) <= adaptive.target_error * fmaxf(mean, RA_ADAPTIVE_MIN_LUMINANCE);
+}
 
-#ifdef __SHADY__
-[[gnu::flatten]]
-#ifdef RA_USE_RT_PIPELINES
-ray_generation_shader
-#else
-compute_shader local_size(16, 16, 1)
-#endif
-#elif __CUDACC__
-__global__
-#endif
-RA_RENDERER_SIGNATURE {
-#ifdef RA_USE_RT_PIPELINES
-    int x = gl_LaunchIDEXT.x;
-    int y = gl_LaunchIDEXT.y;
-#else
-    int x = gl_GlobalInvocationID.x;
-    int y = gl_GlobalInvocationID.y;
-#endif
-    if (x >= width || y >= height)
-        return;
+RA_FUNCTION bool pixel_converged(int x, int y, RA_RENDERER_PARAMS) {
+    if (adaptive.active_tiles[tile_index(x, y, width)] == 0)
+        return true;
+    float n = access_film_plane(film, 4, x, y, width, height);
+    return samples_converged(read_film(film, x, y, width, height), access_film_plane(film, 3, x, y, width, height), n, adaptive);
+}
 
+RA_FUNCTION RNGState seed_pixel_rng(unsigned accum, int x, int y) {
     RNGState rng = 0x811C9DC5;
     rng = fnv_hash(rng, accum);
     rng = fnv_hash(rng, x);
     rng = fnv_hash(rng, y);
+    return rng;
+}
 
+RA_FUNCTION Ray generate_primary_ray(Camera cam, int x, int y, int width, int height, RNGState* rng) {
     const auto camera_scale = camera_scale_from_hfov(cam.fov, width/(float)height);
-    float dx = ((x + randf(&rng)) / (float) width) * 2.0f - 1;
-    float dy = ((y + randf(&rng)) / (float) height) * 2.0f - 1;
+    float dx = ((x + randf(rng)) / (float) width) * 2.0f - 1;
+    float dy = ((y + randf(rng)) / (float) height) * 2.0f - 1;
     vec3 origin = cam.position;
 
-    Ray r = { origin, normalize(-cam.right * camera_scale[0] * dx + cam.up * camera_scale[1]*dy - cam.direction), 0, 99999 };
+    return Ray { origin, normalize(-cam.right * camera_scale[0] * dx + cam.up * camera_scale[1]*dy - cam.direction), 0, 99999 };
+}
 
-    access_frame_buffer(fb, x, y, width, height) = pack_color(vec3(1, 1, 1));
+RA_FUNCTION vec3 shade_primary_hit(int x, int y, Ray r, bool found, Hit nearest_hit, int iter, RNGState* rng, RA_RENDERER_PARAMS) {
     switch (mode) {
         default:
         case FACENORMAL: {
             vec3 color = vec3(0.0f, 0.5f, 1.0f);
-
-            //Hit nearest_hit = { .t = r.tmin, .prim_id = -1 };
-            Hit nearest_hit { };
-            nearest_hit.t = r.tmin;
-            nearest_hit.prim_id = -1;
-            int iter;
-            bvh.intersect(r, nearest_hit, &iter);
-
-            if (nearest_hit.t > 0.0f && nearest_hit.prim_id >= 0) {
-                Triangle tri = bvh.tris[nearest_hit.prim_id];
-                color = color_normal(tri.get_face_normal());
+            if (found) {
+                color = color_normal(bvh.get_surface(geometry, r, nearest_hit).face_normal);
             }
             access_frame_buffer(fb, x, y, width, height) = pack_color(color);
             break;
         }
         case VERTEXNORMAL: {
             vec3 color = vec3(0.0f, 0.5f, 1.0f);
-
-            Hit nearest_hit { };
-            nearest_hit.t = r.tmin;
-            nearest_hit.prim_id = -1;
-            int iter;
-            bvh.intersect(r, nearest_hit, &iter);
-
-            if (nearest_hit.t > 0.0f && nearest_hit.prim_id >= 0) {
-                Triangle tri = bvh.tris[nearest_hit.prim_id];
-                color = color_normal(tri.get_vertex_normal(nearest_hit.primary));
+            if (found) {
+                color = color_normal(bvh.get_surface(geometry, r, nearest_hit).normal);
             }
             access_frame_buffer(fb, x, y, width, height) = pack_color(color);
             break;
         }
         case TEXCOORDS: {
             vec3 color = vec3(0.0f, 0.0f, 0.0f);
-
-            //Hit nearest_hit = { .t = r.tmin, .prim_id = -1 };
-            Hit nearest_hit { };
-            nearest_hit.t = r.tmin;
-            nearest_hit.prim_id = -1;
-            int iter;
-            bvh.intersect(r, nearest_hit, &iter);
-
-            if (nearest_hit.t > 0.0f && nearest_hit.prim_id >= 0) {
-                Triangle tri = bvh.tris[nearest_hit.prim_id];
-                color.xy = tri.get_texcoords(nearest_hit.primary);
+            if (found) {
+                color.xy = bvh.get_surface(geometry, r, nearest_hit).texcoords;
             }
             access_frame_buffer(fb, x, y, width, height) = pack_color(color);
             break;
         }
         case PRIM_IDS: {
             vec3 color = vec3(0.0f, 0.0f, 0.0f);
-
-            //Hit nearest_hit = { .t = r.tmin, .prim_id = -1 };
-            Hit nearest_hit { };
-            nearest_hit.t = r.tmin;
-            nearest_hit.prim_id = -1;
-            int iter;
-            bvh.intersect(r, nearest_hit, &iter);
-
-            if (nearest_hit.t > 0.0f && nearest_hit.prim_id >= 0) {
+            if (found) {
                 color = color_palette(nearest_hit.prim_id);
             }
             access_frame_buffer(fb, x, y, width, height) = pack_color(color);
             break;
         }
-        case PRIMARY_HEATMAP: {
-            Hit nearest_hit = { r.tmin };
-            int iter;
-            bvh.intersect(r, nearest_hit, &iter);
-            access_frame_buffer(fb, x, y, width, height) = pack_color(vec3(log2f(iter) / 8.0f));
-            break;
-        }
-        case AO: {
-            vec3 color = pathtrace_ao(&rng, bvh, triangles, r);
-
-            vec3 film_data = vec3(0);
-            if (accum > 0) {
-                film_data = read_film(film, x, y, width, height);
-            }
-            film_data = film_data + color;
-            write_film(film, x, y, width, height, film_data);
-            access_frame_buffer(fb, x, y, width, height) = pack_color(1.0f * film_data / (accum + 1));
-            break;
-        }
+        case PRIMARY_HEATMAP:
+            return vec3((float) iter);
+        case AO:
+            return pathtrace_ao_hit(rng, bvh, geometry, r, found, nearest_hit);
         case PT:
         case PT_NEE: {
             RenderContext ctx {
-                .primitives = triangles,
+                .geometry = &geometry,
                 .materials = materials,
                 .num_lights = nlights, // Note: there is always an environment map (but maybe black though)
                 .emitters = emitters,
@@ -192,18 +145,94 @@ RA_RENDERER_SIGNATURE {
                 .enable_nee = (mode == PT_NEE) && nlights > 1
             };
 
-            vec3 color = clamp(pathtrace(&rng, r, 0, vec3(1.0f), 1.0f, ctx), vec3(0.0), vec3(100.0f));
+            return clamp(pathtrace_hit(rng, r, found, nearest_hit, 0, vec3(1.0f), 1.0f, ctx), vec3(0.0), vec3(100.0f));
+        }
+    }
+    return vec3(0);
+}
 
-            vec3 film_data = vec3(0);
-            if (accum > 0) {
-                film_data = read_film(film, x, y, width, height);
-            }
-            film_data = film_data + color;
-            write_film(film, x, y, width, height, film_data);
-            access_frame_buffer(fb, x, y, width, height) = pack_color(1.0f * film_data / (accum + 1));
-            break;
+RA_FUNCTION void write_pixel_samples(int x, int y, vec3 sum, float sum_lum2, RA_RENDERER_PARAMS) {
+    if (mode == PRIMARY_HEATMAP) {
+        // The film keeps the sum of the traversal steps over the accumulated frames, for the driver to report
+        vec3 film_data = vec3(0);
+        if (accum > 0) {
+            film_data = read_film(film, x, y, width, height);
+        }
+        write_film(film, x, y, width, height, film_data + sum);
+        access_frame_buffer(fb, x, y, width, height) = pack_color(vec3(log2f(sum.x / spp) / 8.0f));
+    } else if (adaptive_sampling_enabled(adaptive, mode)) {
+        // Pixels stop at different sample counts, so each one keeps its own
+        float lum2 = 0;
+        float n = 0;
+        if (accum > 0) {
+            sum = sum + read_film(film, x, y, width, height);
+            lum2 = access_film_plane(film, 3, x, y, width, height);
+            n = access_film_plane(film, 4, x, y, width, height);
         }
+        lum2 += sum_lum2;
+        n += spp;
+        write_film(film, x, y, width, height, sum);
+        access_film_plane(film, 3, x, y, width, height) = lum2;
+        access_film_plane(film, 4, x, y, width, height) = n;
+        access_frame_buffer(fb, x, y, width, height) = pack_color(sum / n);
+        if (!samples_converged(sum, lum2, n, adaptive))
+            adaptive.next_active_tiles[tile_index(x, y, width)] = 1;
+    } else if (mode_accumulates(mode)) {
+        accumulate_film(film, fb, x, y, width, height, accum, sum, spp);
+    }
+}
+
+extern "C" {
+
+#ifdef __SHADY__
+#include "shady.h"
+using namespace vcc;
+#elif __CUDACC__
+#define gl_GlobalInvocationID (uint3(threadIdx.x + blockDim.x * blockIdx.x, threadIdx.y + blockDim.y * blockIdx.y, threadIdx.z + blockDim.z * blockIdx.z))
+#else
+thread_local extern vec2 gl_GlobalInvocationID;
+#endif
+
+#ifdef __SHADY__
+[[gnu::flatten]]
+#ifdef RA_USE_RT_PIPELINES
+ray_generation_shader
+#else
+compute_shader local_size(16, 16, 1)
+#endif
+#elif __CUDACC__
+__global__
+#endif
+RA_RENDERER_SIGNATURE {
+#ifdef RA_USE_RT_PIPELINES
+    int x = gl_LaunchIDEXT.x;
+    int y = gl_LaunchIDEXT.y;
+#else
+    int x = gl_GlobalInvocationID.x;
+    int y = gl_GlobalInvocationID.y;
+#endif
+    if (x >= width || y >= height)
+        return;
+    // Converged pixels keep their film as is, whole tiles of them are skipped without reading it
+    if (adaptive_sampling_enabled(adaptive, mode) && accum > 0 && pixel_converged(x, y, RA_RENDERER_ARGS))
+        return;
+
+    // The samples are added up here and go to the film once
+    vec3 sum = vec3(0);
+    float sum_lum2 = 0;
+    int samples = mode_accumulates(mode) ? spp : 1;
+    for (int sample = 0; sample < samples; sample++) {
+        RNGState rng = seed_pixel_rng(accum + sample, x, y);
+        Ray r = generate_primary_ray(cam, x, y, width, height, &rng);
+
+        Hit nearest_hit { .t = r.tmax, .prim_id = -1 };
+        int iter;
+        bool found = bvh.intersect(r, nearest_hit, &iter);
+        vec3 color = shade_primary_hit(x, y, r, found, nearest_hit, iter, &rng, RA_RENDERER_ARGS);
+        sum = sum + color;
+        sum_lum2 += color_luminance(color) * color_luminance(color);
     }
+    write_pixel_samples(x, y, sum, sum_lum2, RA_RENDERER_ARGS);
 }
 
 }
@@ -9,6 +9,7 @@ using namespace nasl;
 #include "material.h"
 #include "emitter.h"
 #include "bvh.h"
+#include "texture.h"
 
 enum RenderMode {
     FACENORMAL,
@@ -24,6 +25,64 @@ enum RenderMode {
     DEFAULT_RENDER_MODE = PT_NEE,
 };
 
-#define RA_RENDERER_SIGNATURE void render_a_pixel(Camera cam, int width, int height, uint32_t* fb, float* film, int ntris, Triangle* triangles, Material* materials, int nlights, Emitter* emitters, BVH bvh, const TextureDescriptor* texture_descriptors, const unsigned char* texture_data, unsigned frame, unsigned accum, RenderMode mode, int max_depth)
+// Modes that add up their samples in the film, the others only show the last one
+inline RA_FUNCTION bool mode_accumulates(RenderMode mode) {
+    return mode == PRIMARY_HEATMAP || mode == AO || mode == PT || mode == PT_NEE;
+}
+
+// Pixels are grouped in tiles of RA_TILE_SIZE x RA_TILE_SIZE, which are also the workgroups of render_a_pixel
+#define RA_TILE_SIZE 16
+
+inline RA_FUNCTION int tile_index(int x, int y, int width) {
+    int tiles_x = (width + RA_TILE_SIZE - 1) / RA_TILE_SIZE;
+    return (y / RA_TILE_SIZE) * tiles_x + x / RA_TILE_SIZE;
+}
+
+// The film holds the sum of the samples of each pixel in its first three planes. With adaptive sampling, the fourth
+// holds the sum of their squared luminances and the fifth how many samples the pixel took.
+#define RA_FILM_PLANES 5
+
+// Adaptive sampling: in AO, PT and PT_NEE, pixels stop taking samples once the standard error of their mean luminance
+// falls under `target_error` times the mean (see RA_ADAPTIVE_MIN_LUMINANCE). Tiles without such pixels left are
+// skipped as a whole.
+struct AdaptiveSampling {
+    // 0 takes a sample in every pixel, every frame
+    float target_error;
+    // Samples a pixel takes before its error estimate is trusted
+    int min_samples;
+    // Non-zero for the tiles that still had unconverged pixels in the last frame
+    const uint32_t* active_tiles;
+    // Where this frame flags them, has to be cleared before each frame. Every pixel writes the same value, so plain
+    // stores do and the kernel needs no atomics.
+    uint32_t* next_active_tiles;
+};
+
+// The error of darker pixels is taken relative to this luminance instead of their mean, or they would hardly converge
+#define RA_ADAPTIVE_MIN_LUMINANCE (1.0f / 256.0f)
+
+inline RA_FUNCTION bool adaptive_sampling_enabled(const AdaptiveSampling& adaptive, RenderMode mode) {
+    return adaptive.target_error > 0 && (mode == AO || mode == PT || mode == PT_NEE);
+}
+
+// `accum` samples are in the film already, and each launch adds `spp` more: sample i is seeded with accum + i, so one
+// launch with spp = N traces the same paths as N launches with spp = 1
+#define RA_RENDERER_PARAMS Camera cam, int width, int height, uint32_t* fb, float* film, int ntris, Geometry geometry, Material* materials, int nlights, Emitter* emitters, BVH bvh, const TextureDescriptor* texture_descriptors, const unsigned char* texture_data, unsigned frame, unsigned accum, RenderMode mode, int max_depth, int spp, AdaptiveSampling adaptive
+#define RA_RENDERER_ARGS cam, width, height, fb, film, ntris, geometry, materials, nlights, emitters, bvh, texture_descriptors, texture_data, frame, accum, mode, max_depth, spp, adaptive
+
+#define RA_RENDERER_SIGNATURE void render_a_pixel(RA_RENDERER_PARAMS)
+// CPU only, renders the RA_PACKET_WIDTH x RA_PACKET_HEIGHT pixels starting at gl_GlobalInvocationID
+#define RA_PACKET_RENDERER_SIGNATURE void render_a_packet(RA_RENDERER_PARAMS)
+
+// Adds the sum of `samples` samples to the film, which holds `accum` samples already
+RA_FUNCTION void accumulate_film(float* film, uint32_t* fb, int x, int y, int width, int height, unsigned accum, vec3 color, int samples);
+RA_FUNCTION RNGState seed_pixel_rng(unsigned accum, int x, int y);
+RA_FUNCTION Ray generate_primary_ray(Camera cam, int x, int y, int width, int height, RNGState* rng);
+// Returns what the sample adds to the film in the modes that accumulate, the others write the frame buffer directly
+RA_FUNCTION vec3 shade_primary_hit(int x, int y, Ray r, bool found, Hit nearest_hit, int iter, RNGState* rng, RA_RENDERER_PARAMS);
+// Whether a pixel is done taking samples, see AdaptiveSampling. Only to be called once the film holds samples.
+RA_FUNCTION bool pixel_converged(int x, int y, RA_RENDERER_PARAMS);
+// Writes the sum of the `spp` samples returned by shade_primary_hit for a pixel, and the sum of their squared
+// luminances for adaptive sampling
+RA_FUNCTION void write_pixel_samples(int x, int y, vec3 sum, float sum_lum2, RA_RENDERER_PARAMS);
 
 #endif
@@ -0,0 +1,156 @@
+#include "stream.h"
+#include "packet.h"
+#include "pt.h"
+
+#include <algorithm>
+#include <vector>
+
+struct StreamPath {
+    PathState state;
+    vec3 color;
+    int pixel;
+};
+
+// Direction octant in the top bits, then the Morton code of the cell containing the origin
+static uint32_t stream_sort_key(const Ray& ray, vec3 grid_min, vec3 inv_cell_size) {
+    const int cells = 1 << RA_STREAM_GRID_BITS;
+    uint32_t octant = (ray.dir.x < 0 ? 1 : 0) | (ray.dir.y < 0 ? 2 : 0) | (ray.dir.z < 0 ? 4 : 0);
+    uint32_t cell[3];
+    for (int axis = 0; axis < 3; axis++) {
+        float f = (ray.origin.arr[axis] - grid_min.arr[axis]) * inv_cell_size.arr[axis];
+        cell[axis] = f > 0 ? (uint32_t) std::min(f, (float) (cells - 1)) : 0;
+    }
+    uint32_t morton = 0;
+    for (int bit = 0; bit < RA_STREAM_GRID_BITS; bit++) {
+        for (int axis = 0; axis < 3; axis++)
+            morton |= ((cell[axis] >> bit) & 1) << (bit * 3 + axis);
+    }
+    return (octant << (3 * RA_STREAM_GRID_BITS)) | morton;
+}
+
+extern "C" {
+
+RA_STREAM_RENDERER_SIGNATURE {
+    RenderContext ctx {
+        .geometry = &geometry,
+        .materials = materials,
+        .num_lights = nlights, // Note: there is always an environment map (but maybe black though)
+        .emitters = emitters,
+        .bvh = &bvh,
+        .textures = TextureSystem {
+            .bytes = texture_data,
+            .textures = texture_descriptors
+        },
+
+        .max_depth = max_depth,
+        .enable_nee = (mode == PT_NEE) && nlights > 1
+    };
+
+    // The root node covers the whole scene
+    BVH::Node root = bvh.nodes[bvh.root];
+    vec3 grid_min = root.origin;
+    vec3 inv_cell_size;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = root.scale.arr[axis] * BVH_QUANTIZATION_STEPS;
+        inv_cell_size.arr[axis] = extent > 0 ? (1 << RA_STREAM_GRID_BITS) / extent : 0;
+    }
+
+    std::vector<StreamPath> paths;
+    std::vector<std::pair<uint32_t, int>> active, next;
+    std::vector<Hit> hits;
+    std::vector<bool> found;
+    std::vector<std::pair<int, int>> shade_order;
+    std::vector<vec3> sums;
+    paths.reserve(RA_STREAM_BATCH_SIZE);
+    active.reserve(RA_STREAM_BATCH_SIZE);
+    next.reserve(RA_STREAM_BATCH_SIZE);
+
+    for (int first = 0; first < width * height; first += RA_STREAM_BATCH_SIZE) {
+        int count = std::min(RA_STREAM_BATCH_SIZE, width * height - first);
+
+        // The samples of each pixel are added up here and go to the film once
+        sums.assign(count, vec3(0.0f));
+        for (int sample = 0; sample < spp; sample++) {
+            paths.clear();
+            active.clear();
+            for (int i = 0; i < count; i++) {
+                int x = (first + i) % width;
+                int y = (first + i) / width;
+                RNGState rng = seed_pixel_rng(accum + sample, x, y);
+                Ray r = generate_primary_ray(cam, x, y, width, height, &rng);
+                paths.push_back(StreamPath {
+                    .state = PathState {
+                        .rng = rng,
+                        .ray = r,
+                        .throughput = vec3(1.0f),
+                        .prev_pdf = 1.0f,
+                        .depth = 0,
+                    },
+                    .color = vec3(0.0f),
+                    .pixel = first + i,
+                });
+                active.emplace_back(0, i);
+            }
+
+            while (!active.empty()) {
+                // Ties are broken by path index, which keeps the primary rays in scanline order
+                for (auto& [key, i] : active)
+                    key = stream_sort_key(paths[i].state.ray, grid_min, inv_cell_size);
+                std::sort(active.begin(), active.end());
+
+                hits.resize(active.size());
+                found.resize(active.size());
+                for (size_t i = 0; i < active.size(); i += RA_PACKET_SIZE) {
+                    Ray rays[RA_PACKET_SIZE];
+                    Hit packet_hits[RA_PACKET_SIZE];
+                    bool packet_found[RA_PACKET_SIZE];
+                    int iterations[RA_PACKET_SIZE];
+                    unsigned mask = 0;
+                    for (int lane = 0; lane < RA_PACKET_SIZE && i + lane < active.size(); lane++) {
+                        rays[lane] = paths[active[i + lane].second].state.ray;
+                        packet_hits[lane] = Hit { .t = rays[lane].tmax, .prim_id = -1 };
+                        mask |= 1u << lane;
+                    }
+                    intersect_packet(bvh, rays, mask, packet_hits, packet_found, iterations);
+                    for (int lane = 0; lane < RA_PACKET_SIZE && i + lane < active.size(); lane++) {
+                        hits[i + lane] = packet_hits[lane];
+                        found[i + lane] = packet_found[lane];
+                    }
+                }
+
+                // Misses go first, then the hits of each material back to back, still in ray order within a material
+                shade_order.clear();
+                for (size_t j = 0; j < active.size(); j++)
+                    shade_order.emplace_back(sort_materials && found[j] ? bvh.get_material(geometry, hits[j]) + 1 : 0, j);
+                if (sort_materials)
+                    std::sort(shade_order.begin(), shade_order.end());
+
+                next.clear();
+                uint64_t shadow_rays = 0;
+                for (auto [material, j] : shade_order) {
+                    StreamPath& path = paths[active[j].second];
+                    ShadowRay shadow;
+                    bool connect = false;
+                    bool bounced = pathtrace_shade(path.state, found[j], hits[j], &path.color, &shadow, &connect, ctx);
+                    if (connect) {
+                        shadow_rays++;
+                        if (!bvh.intersect_shadow(shadow.ray))
+                            path.color = path.color + shadow.contrib;
+                    }
+                    if (bounced)
+                        next.push_back(active[j]);
+                }
+                *rays_traced += active.size() + shadow_rays;
+                std::swap(active, next);
+            }
+
+            for (int i = 0; i < count; i++)
+                sums[i] = sums[i] + clamp(paths[i].color, vec3(0.0), vec3(100.0f));
+        }
+
+        for (int i = 0; i < count; i++)
+            accumulate_film(film, fb, (first + i) % width, (first + i) / width, width, height, accum, sums[i], spp);
+    }
+}
+
+}
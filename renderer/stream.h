@@ -0,0 +1,21 @@
+#ifndef RA_STREAM_H_
+#define RA_STREAM_H_
+
+#include "renderer.h"
+
+#include <cstdint>
+
+// CPU only: PT and PT_NEE are rendered one bounce at a time over batches of paths. Before each bounce, the rays of
+// the batch are sorted by direction octant and origin cell, and traced in that order as packets, so that rays
+// following each other visit the same nodes and triangles while they are still in cache.
+
+// Number of paths kept in flight
+#define RA_STREAM_BATCH_SIZE (1 << 16)
+// The scene bounds are split into a grid of 2^RA_STREAM_GRID_BITS cells per axis for sorting
+#define RA_STREAM_GRID_BITS 8
+
+// Renders the whole frame at once, the pixels are not taken from gl_GlobalInvocationID. With `sort_materials`, the hits
+// of each bounce are shaded grouped by material. Adds the number of rays traced, shadow rays included, to `rays_traced`.
+#define RA_STREAM_RENDERER_SIGNATURE void render_a_stream(RA_RENDERER_PARAMS, bool sort_materials, uint64_t* rays_traced)
+
+#endif
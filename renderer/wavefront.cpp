@@ -0,0 +1,170 @@
+#include "wavefront.h"
+#include "rendercontext.h"
+
+RA_FUNCTION int wavefront_material_bin(const Geometry& geometry, const BVH& bvh, const Hit& hit) {
+    return hit.prim_id >= 0 ? bvh.get_material(geometry, hit) + 1 : 0;
+}
+
+extern "C" {
+
+#ifdef __SHADY__
+#include "shady.h"
+using namespace vcc;
+#elif __CUDACC__
+#define gl_GlobalInvocationID (uint3(threadIdx.x + blockDim.x * blockIdx.x, threadIdx.y + blockDim.y * blockIdx.y, threadIdx.z + blockDim.z * blockIdx.z))
+#else
+thread_local extern vec2 gl_GlobalInvocationID;
+#endif
+
+#ifdef __SHADY__
+compute_shader local_size(16, 16, 1)
+#elif __CUDACC__
+__global__
+#endif
+RA_WAVEFRONT_GENERATE_SIGNATURE {
+    int x = gl_GlobalInvocationID.x;
+    int y = gl_GlobalInvocationID.y;
+    if (x >= width || y >= height)
+        return;
+
+    int pixel = y * width + x;
+    vec3 sum = vec3(0.0f);
+    if (sample > 0)
+        sum = queues.paths[pixel].sum + clamp(queues.paths[pixel].color, vec3(0.0), vec3(100.0f));
+
+    RNGState rng = seed_pixel_rng(accum + sample, x, y);
+    Ray r = generate_primary_ray(cam, x, y, width, height, &rng);
+    queues.paths[pixel] = WavefrontPath {
+        .state = PathState {
+            .rng = rng,
+            .ray = r,
+            .throughput = vec3(1.0f),
+            .prev_pdf = 1.0f,
+            .depth = 0,
+        },
+        .color = vec3(0.0f),
+        .sum = sum,
+    };
+    // Every path starts alive, so the first queue needs no compaction
+    queues.rays[pixel] = pixel;
+}
+
+#ifdef __SHADY__
+[[gnu::flatten]]
+compute_shader local_size(WAVEFRONT_LOCAL_SIZE, 1, 1)
+#elif __CUDACC__
+__global__
+#endif
+RA_WAVEFRONT_EXTEND_SIGNATURE {
+    int i = gl_GlobalInvocationID.x;
+    if (i >= count)
+        return;
+
+    Ray r = queues.paths[queues.rays[i]].state.ray;
+    Hit hit { .t = r.tmax, .prim_id = -1 };
+    bvh.intersect(r, hit);
+    queues.hits[i] = hit;
+}
+
+#ifdef __SHADY__
+compute_shader local_size(WAVEFRONT_LOCAL_SIZE, 1, 1)
+#elif __CUDACC__
+__global__
+#endif
+RA_WAVEFRONT_BIN_SIGNATURE {
+    int i = gl_GlobalInvocationID.x;
+    if (i >= count)
+        return;
+
+    atomic_increment(&queues.material_bins[wavefront_material_bin(geometry, bvh, queues.hits[i])]);
+}
+
+#ifdef __SHADY__
+compute_shader local_size(WAVEFRONT_LOCAL_SIZE, 1, 1)
+#elif __CUDACC__
+__global__
+#endif
+RA_WAVEFRONT_SORT_SIGNATURE {
+    int i = gl_GlobalInvocationID.x;
+    if (i >= count)
+        return;
+
+    queues.shade_order[atomic_increment(&queues.material_bins[wavefront_material_bin(geometry, bvh, queues.hits[i])])] = i;
+}
+
+#ifdef __SHADY__
+[[gnu::flatten]]
+compute_shader local_size(WAVEFRONT_LOCAL_SIZE, 1, 1)
+#elif __CUDACC__
+__global__
+#endif
+RA_WAVEFRONT_SHADE_SIGNATURE {
+    int i = gl_GlobalInvocationID.x;
+    if (i >= count)
+        return;
+    if (queues.shade_order)
+        i = queues.shade_order[i];
+
+    RenderContext ctx {
+        .geometry = &geometry,
+        .materials = materials,
+        .num_lights = nlights, // Note: there is always an environment map (but maybe black though)
+        .emitters = emitters,
+        .bvh = &bvh,
+        .textures = TextureSystem {
+            .bytes = texture_data,
+            .textures = texture_descriptors
+        },
+
+        .max_depth = max_depth,
+        .enable_nee = (mode == PT_NEE) && nlights > 1
+    };
+
+    int path = queues.rays[i];
+    WavefrontPath p = queues.paths[path];
+    Hit hit = queues.hits[i];
+    ShadowRay shadow;
+    bool connect = false;
+    bool bounced = pathtrace_shade(p.state, hit.prim_id >= 0, hit, &p.color, &shadow, &connect, ctx);
+    queues.paths[path] = p;
+
+    if (connect)
+        queues.shadow_rays[atomic_increment(&queues.counters[WAVEFRONT_SHADOW_RAYS])] = WavefrontShadowRay { .shadow = shadow, .path = path };
+    if (bounced)
+        queues.next_rays[atomic_increment(&queues.counters[WAVEFRONT_NEXT_RAYS])] = path;
+}
+
+#ifdef __SHADY__
+[[gnu::flatten]]
+compute_shader local_size(WAVEFRONT_LOCAL_SIZE, 1, 1)
+#elif __CUDACC__
+__global__
+#endif
+RA_WAVEFRONT_CONNECT_SIGNATURE {
+    int i = gl_GlobalInvocationID.x;
+    if (i >= count)
+        return;
+
+    // A path has at most one shadow ray per bounce, so no other thread writes to its color
+    WavefrontShadowRay s = queues.shadow_rays[i];
+    if (!bvh.intersect_shadow(s.shadow.ray))
+        queues.paths[s.path].color = queues.paths[s.path].color + s.shadow.contrib;
+}
+
+#ifdef __SHADY__
+compute_shader local_size(16, 16, 1)
+#elif __CUDACC__
+__global__
+#endif
+RA_WAVEFRONT_ACCUMULATE_SIGNATURE {
+    int x = gl_GlobalInvocationID.x;
+    int y = gl_GlobalInvocationID.y;
+    if (x >= width || y >= height)
+        return;
+
+    WavefrontPath p = queues.paths[y * width + x];
+    vec3 sum = p.sum + clamp(p.color, vec3(0.0), vec3(100.0f));
+    accumulate_film(film, fb, x, y, width, height, accum, sum, spp);
+}
+
+}
@@ -0,0 +1,81 @@
+#ifndef RA_WAVEFRONT_H_
+#define RA_WAVEFRONT_H_
+
+#include "renderer.h"
+#include "pt.h"
+
+// PT and PT_NEE rendered as a pipeline of small kernels instead of one render_a_pixel per path. Every bounce, the
+// live paths are extended to their closest hit, then shaded, then their shadow rays are traced. The kernels pass
+// paths to each other through queues of path indices, and shading compacts the paths that go on into the next queue.
+// The host swaps the two ray queues and resets the counters between bounces.
+// Before shading, the hits can be sorted by material with a counting sort: wavefront_bin_materials counts the hits of
+// each material, the host turns the counts into offsets, and wavefront_sort_materials scatters the queue entries into
+// shade_order. Neighbouring threads of wavefront_shade then run the same BSDF on the same textures.
+
+// Indices into WavefrontQueues::counters
+#define WAVEFRONT_NEXT_RAYS 0
+#define WAVEFRONT_SHADOW_RAYS 1
+#define WAVEFRONT_COUNTERS 2
+
+// Threads per workgroup of the kernels that work on queues
+#define WAVEFRONT_LOCAL_SIZE 64
+
+// Pushes to the queues and counts the material bins, returns the previous value. With vcc, this is the atomicrmw that
+// clang emits for the builtin, which shady has to turn into a SPIR-V atomic. That has not been compiled by vcc or run
+// on a device yet, so the driver only runs the wavefront renderer on the CPU.
+inline RA_FUNCTION uint32_t atomic_increment(uint32_t* counter) {
+#ifdef __CUDACC__
+    return atomicAdd(counter, 1u);
+#else
+    return __atomic_fetch_add(counter, 1u, __ATOMIC_RELAXED);
+#endif
+}
+
+struct WavefrontPath {
+    PathState state;
+    vec3 color;
+    // Clamped colors of the previous samples of the launch
+    vec3 sum;
+};
+
+struct WavefrontShadowRay {
+    ShadowRay shadow;
+    int path;
+};
+
+// All arrays hold one entry per pixel, which is the most paths that can be in flight
+struct WavefrontQueues {
+    // Indexed by pixel
+    WavefrontPath* paths;
+    // Paths to extend and shade in this bounce
+    int* rays;
+    // Closest hit of rays[i], prim_id is negative if there is none
+    Hit* hits;
+    // Paths that go on to the next bounce
+    int* next_rays;
+    WavefrontShadowRay* shadow_rays;
+    uint32_t* counters;
+    // Entries of `rays` in the order to shade them, null to shade them in queue order
+    int* shade_order;
+    // Bin 0 is for misses, then one bin per material
+    uint32_t* material_bins;
+};
+
+#define RA_WAVEFRONT_SCENE_PARAMS Geometry geometry, Material* materials, int nlights, Emitter* emitters, BVH bvh, const TextureDescriptor* texture_descriptors, const unsigned char* texture_data, RenderMode mode, int max_depth
+
+// One thread per pixel, in workgroups of 16x16 like render_a_pixel. Starts sample `sample` of the launch.
+#define RA_WAVEFRONT_GENERATE_SIGNATURE void wavefront_generate(Camera cam, int width, int height, unsigned accum, int sample, WavefrontQueues queues)
+// One thread per entry of the ray queue
+#define RA_WAVEFRONT_EXTEND_SIGNATURE void wavefront_extend(int count, BVH bvh, WavefrontQueues queues)
+// One thread per entry of the ray queue, counts the hits into material_bins
+#define RA_WAVEFRONT_BIN_SIGNATURE void wavefront_bin_materials(int count, Geometry geometry, BVH bvh, WavefrontQueues queues)
+// One thread per entry of the ray queue, material_bins has to hold the first slot of each bin in shade_order
+#define RA_WAVEFRONT_SORT_SIGNATURE void wavefront_sort_materials(int count, Geometry geometry, BVH bvh, WavefrontQueues queues)
+// One thread per entry of the ray queue
+#define RA_WAVEFRONT_SHADE_SIGNATURE void wavefront_shade(int count, RA_WAVEFRONT_SCENE_PARAMS, WavefrontQueues queues)
+// One thread per entry of the shadow ray queue
+#define RA_WAVEFRONT_CONNECT_SIGNATURE void wavefront_connect(int count, BVH bvh, WavefrontQueues queues)
+// One thread per pixel, in workgroups of 16x16, adds the colors of the `spp` samples to the film
+#define RA_WAVEFRONT_ACCUMULATE_SIGNATURE void wavefront_accumulate(int width, int height, uint32_t* fb, float* film, unsigned accum, int spp, WavefrontQueues queues)
+
+#endif